@@ -45,6 +45,16 @@ constexpr unsigned SPREADSHEET_SPEED = 0x08;
 constexpr unsigned SPREADSHEET_PARSER = 0x10;
 #endif /* __PROGTEST__ */
 
+#include <bitset>
+#include <bit>
+#include <limits>
+#include <string_view>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
 
 //-------------------------------------------------------------START--------------------------------------------------------------------------------//
 //Class to find Cell position
@@ -99,999 +109,3602 @@ private:
 
 };
 
-class TreeNode;
+class Program;
+class CellGrid;
 
-//Class representing a cell in a spreadsheet
-class Cell {
+//Text interned by a StringPool together with the number of references to it
+struct InternedText {
+    std::atomic<uint32_t> references{0};
+    std::string text;
+};
+
+//Counted reference to an interned text, all cells holding the same text share one string. The references only count,
+//the pool owns the texts and frees the unreferenced ones when it sweeps, so it has to outlive them (see CellGrid).
+class InternedString {
 public:
-    void setValue(const CValue &val);
+    InternedString() = default;
 
-    CValue getValue(){
-        return value;
+    InternedString(const InternedString& other) : entry(other.entry) {
+        if (entry)
+            entry->references.fetch_add(1, std::memory_order_relaxed);
     }
 
-    void setExpressionTree(std::shared_ptr<TreeNode> tree, const std::string& expr);
+    InternedString(InternedString&& other) noexcept : entry(std::exchange(other.entry, nullptr)) {}
 
-    CValue evaluate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>>& context);
+    InternedString& operator=(InternedString other) noexcept {
+        std::swap(entry, other.entry);
+        return *this;
+    }
 
-    std::shared_ptr<Cell> clone() const;
+    ~InternedString() {
+        if (entry)
+            entry->references.fetch_sub(1, std::memory_order_release);
+    }
 
-    std::shared_ptr<TreeNode> getExpressionTree() const;
+    const std::string& operator*() const {
+        return entry->text;
+    }
 
-    std::string getExpressionString() const{
-        return expressionString;
+    const std::string* operator->() const {
+        return &entry->text;
     }
 
-private:
-    CValue value;
-    std::shared_ptr<TreeNode> expressionTree;
-    std::string expressionString;
+    explicit operator bool() const {
+        return entry;
+    }
 
-};
+    //A pool interns every text once, so equal texts of one pool are the same entry
+    bool operator==(const InternedString& other) const {
+        return entry == other.entry;
+    }
 
+private:
+    friend class StringPool;
 
-//Abstract Class representing a node of the Abstract Syntax Tree
-class TreeNode {
-public:
-    virtual ~TreeNode() {}
-    virtual CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &) const = 0;
-    virtual std::shared_ptr<TreeNode> clone() const = 0;
-    virtual std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const = 0;
-    virtual std::string toString() const = 0;
-    virtual std::set<std::pair<int, int>> getReferences() const = 0;
-};
+    InternedText* entry = nullptr;
 
-class AddNode : public TreeNode {
-private:
-    std::shared_ptr<TreeNode> left;
-    std::shared_ptr<TreeNode> right;
+    explicit InternedString(InternedText* interned) : entry(interned) {
+        entry->references.fetch_add(1, std::memory_order_relaxed);
+    }
+};
 
+//Class representing a cell in a spreadsheet. The cell is a 16 byte tagged slot: a number is stored in place, a text
+//as the reference to its interned string, and a formula as a pointer to its own Formula, which holds everything only
+//formulas need. A block of cells is then mostly numbers and pointers instead of 40 byte values.
+class Cell {
 public:
-    AddNode(std::shared_ptr<TreeNode> lhs, std::shared_ptr<TreeNode> rhs) : left(lhs), right(rhs) {}
+    Cell() : number(0) {}
+
+    Cell(const Cell& other) : Cell() {
+        copyFrom(other);
+    }
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        auto lval = left->calculate(context);
-        auto rval = right->calculate(context);
+    Cell(Cell&& other) noexcept : Cell() {
+        moveFrom(other);
+    }
 
-        if (std::holds_alternative<std::string>(lval) || std::holds_alternative<std::string>(rval)) {
-            std::string leftStr = std::holds_alternative<std::string>(lval) ? std::get<std::string>(lval) : std::to_string(std::get<double>(lval));
-            std::string rightStr = std::holds_alternative<std::string>(rval) ? std::get<std::string>(rval) : std::to_string(std::get<double>(rval));
-            return leftStr + rightStr;
+    Cell& operator=(const Cell& other) {
+        if (this != &other) {
+            Cell copy(other);
+            reset();
+            moveFrom(copy);
         }
+        return *this;
+    }
 
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) + std::get<double>(rval);
+    Cell& operator=(Cell&& other) noexcept {
+        if (this != &other) {
+            reset();
+            moveFrom(other);
         }
+        return *this;
+    }
 
-        return std::monostate();
+    ~Cell() {
+        reset();
     }
 
-    std::shared_ptr<TreeNode> clone() const override {
-        return std::make_shared<AddNode>(left->clone(), right->clone());
+    void setValue(double value) {
+        reset();
+        number = value;
+        kind = Kind::Number;
     }
 
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<AddNode>(left->adjustReferences(rowOffset, colOffset), right->adjustReferences(rowOffset, colOffset));
+    void setValue(InternedString value) {
+        reset();
+        new (&text) InternedString(std::move(value));
+        kind = Kind::Text;
     }
 
-    std::string toString() const override {
-        return "(" + left->toString() + "+" + right->toString() + ")";
+    //Returns the literal number of the cell, or nullptr when it holds something else
+    const double* getNumber() const {
+        return kind == Kind::Number ? &number : nullptr;
     }
-    std::set<std::pair<int, int>> getReferences() const override {
-        std::set<std::pair<int, int>> refs = left->getReferences();
-        const auto& rightRefs = right->getReferences();
-        refs.insert(rightRefs.begin(), rightRefs.end());
-        return refs;
+
+    //Returns the literal text of the cell, or nullptr when it holds something else
+    const InternedString* getText() const {
+        return kind == Kind::Text ? &text : nullptr;
     }
-};
 
-class SubNode : public TreeNode {
-private:
-    std::shared_ptr<TreeNode> left;
-    std::shared_ptr<TreeNode> right;
+    //Sets the program of the formula at anchor, the position of the cell. The text of the formula is not kept, it is
+    //decompiled from the program when the sheet is saved.
+    void setProgram(std::shared_ptr<const Program> compiled, const std::pair<int, int>& anchor);
 
-public:
-    SubNode(std::shared_ptr<TreeNode> lhs, std::shared_ptr<TreeNode> rhs)
-            : left(lhs), right(rhs) {}
+    //Returns the cached value of an expression, recomputing it only when the cell is dirty
+    CValue evaluate(const CellGrid& context) const;
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        auto lval = left->calculate(context);
-        auto rval = right->calculate(context);
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) - std::get<double>(rval);
-        }
-        return std::monostate();
+    void markDirty() {
+        if (kind == Kind::Formula)
+            formula->dirty = true;
     }
-    std::shared_ptr<TreeNode> clone() const override{
-        return std::make_shared<SubNode>(left->clone(), right->clone());
 
-    }
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<SubNode>(left->adjustReferences(rowOffset, colOffset), right->adjustReferences(rowOffset, colOffset));
-    }
-    std::string toString() const override {
-        return "(" + left->toString() + "-" + right->toString() + ")";
-    }
-    std::set<std::pair<int, int>> getReferences() const override {
-        std::set<std::pair<int, int>> refs = left->getReferences();
-        const auto& rightRefs = right->getReferences();
-        refs.insert(rightRefs.begin(), rightRefs.end());
-        return refs;
+    bool isDirty() const {
+        return kind == Kind::Formula && formula->dirty;
     }
 
-};
+    //A cyclic cell is part of, or depends on, a cycle of references and always evaluates to an undefined value. Only
+    //formulas can be cyclic.
+    void setCyclic(bool value) {
+        if (kind == Kind::Formula)
+            formula->cyclic = value;
+    }
 
-class MulNode : public TreeNode {
-private:
-    std::shared_ptr<TreeNode> left;
-    std::shared_ptr<TreeNode> right;
+    bool isCyclic() const {
+        return kind == Kind::Formula && formula->cyclic;
+    }
 
-public:
-    MulNode(std::shared_ptr<TreeNode> lhs, std::shared_ptr<TreeNode> rhs) : left(lhs), right(rhs) {}
+    //Programs are immutable, so copies of a cell share its program
+    const std::shared_ptr<const Program>& getProgram() const;
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        auto lval = left->calculate(context);
-        auto rval = right->calculate(context);
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) * std::get<double>(rval);
-        }
-        return std::monostate();
+    const std::pair<int, int>& getAnchor() const {
+        return formula->anchor;
     }
-    std::shared_ptr<TreeNode> clone() const override{
-        return std::make_shared<MulNode>(left->clone(), right->clone());
 
+private:
+    enum class Kind : uint8_t { Empty, Number, Text, Formula };
+
+    struct Formula {
+        std::shared_ptr<const Program> program;
+        std::pair<int, int> anchor;
+        CValue cachedValue;
+        bool dirty = true;
+        bool cyclic = false;
+    };
+
+    union {
+        double number;
+        InternedString text;
+        Formula* formula;
+    };
+    Kind kind = Kind::Empty;
+
+    void reset() {
+        if (kind == Kind::Text)
+            text.~InternedString();
+        else if (kind == Kind::Formula)
+            delete formula;
+        number = 0;
+        kind = Kind::Empty;
     }
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<MulNode>(left->adjustReferences(rowOffset, colOffset), right->adjustReferences(rowOffset, colOffset));
-    }
-    std::string toString() const override {
-        return  "(" + left->toString() + "*" + right->toString() + ")" ;
+
+    void copyFrom(const Cell& other) {
+        if (other.kind == Kind::Text)
+            new (&text) InternedString(other.text);
+        else if (other.kind == Kind::Formula)
+            formula = new Formula(*other.formula);
+        else
+            number = other.number;
+        kind = other.kind;
     }
-    std::set<std::pair<int, int>> getReferences() const override {
-        std::set<std::pair<int, int>> refs = left->getReferences();
-        const auto& rightRefs = right->getReferences();
-        refs.insert(rightRefs.begin(), rightRefs.end());
-        return refs;
+
+    //Takes the contents of other, which is left empty
+    void moveFrom(Cell& other) {
+        if (other.kind == Kind::Text) {
+            new (&text) InternedString(std::move(other.text));
+            other.text.~InternedString();
+        } else if (other.kind == Kind::Formula) {
+            formula = other.formula;
+        } else {
+            number = other.number;
+        }
+        kind = other.kind;
+        other.number = 0;
+        other.kind = Kind::Empty;
     }
+};
 
+static_assert(sizeof(Cell) <= 16, "a cell is a 16 byte slot");
 
-};
 
-class NegNode : public TreeNode {
-private:
-    std::shared_ptr<TreeNode> operand;
+//Rectangle of cells given by its upper left and lower right corner, both as (row, column)
+struct CellRange {
+    std::pair<int, int> from;
+    std::pair<int, int> to;
 
-public:
-    NegNode(std::shared_ptr<TreeNode> op) : operand(op) {}
+    CellRange(std::pair<int, int> corner1, std::pair<int, int> corner2)
+            : from(std::min(corner1.first, corner2.first), std::min(corner1.second, corner2.second)),
+              to(std::max(corner1.first, corner2.first), std::max(corner1.second, corner2.second)) {}
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        CValue operandValue = operand->calculate(context);
-        if (std::holds_alternative<double>(operandValue)) {
-            return -std::get<double>(operandValue);
-        }
-        return std::monostate();
+    bool contains(const std::pair<int, int>& cellId) const {
+        return cellId.first >= from.first && cellId.first <= to.first
+               && cellId.second >= from.second && cellId.second <= to.second;
     }
-    std::shared_ptr<TreeNode> clone() const override{
-        return std::make_shared<NegNode>(operand->clone());
 
+    double area() const {
+        return (static_cast<double>(to.first) - from.first + 1) * (static_cast<double>(to.second) - from.second + 1);
     }
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<NegNode>(operand->adjustReferences(rowOffset, colOffset));
-    }
-    std::string toString() const override {
-        return  "-" + operand->toString() ;
-    }
-    std::set<std::pair<int, int>> getReferences() const override {
-        return operand->getReferences();
-    }
-
 };
 
-class PowerNode : public TreeNode {
-private:
-    std::shared_ptr<TreeNode> base;
-    std::shared_ptr<TreeNode> exponent;
-
-public:
-    PowerNode(std::shared_ptr<TreeNode> base, std::shared_ptr<TreeNode> exponent)
-            : base(base), exponent(exponent) {}
+//Aggregated values of a range: sum, minimum and maximum of the numbers, count of numbers and count of defined values
+struct RangeSummary {
+    double sum = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    size_t numbers = 0;
+    size_t values = 0;
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        auto lval = base->calculate(context);
-        auto rval = exponent->calculate(context);
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            double baseValue = std::get<double>(lval);
-            double exponentValue = std::get<double>(rval);
-            return std::pow(baseValue, exponentValue);
+    void add(const CValue& value) {
+        if (std::holds_alternative<double>(value)) {
+            double number = std::get<double>(value);
+            sum += number;
+            min = std::min(min, number);
+            max = std::max(max, number);
+            numbers++;
+            values++;
+        } else if (std::holds_alternative<std::string>(value)) {
+            values++;
         }
-        return std::monostate();
     }
-    std::shared_ptr<TreeNode> clone() const override{
-        return std::make_shared<PowerNode>(base->clone(), exponent->clone());
+};
 
-    }
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<PowerNode>(base->adjustReferences(rowOffset, colOffset), exponent->adjustReferences(rowOffset, colOffset));
-    }
 
-    std::string toString() const override {
-        return  base->toString() + "^" + exponent->toString() ;
+//Aggregates of the literal cells of one column over blocks of 64 rows, kept in a Fenwick tree so that the totals of
+//any span of blocks are found in O(log n) and a changed cell is applied in O(log n). The sum is a double-double
+//(value and rounding error), so repeated updates do not drift. Infinite and NaN numbers cannot be added and removed
+//again, they are only counted and a span holding any of them has to be scanned.
+class ColumnIndex {
+public:
+    //Only rows below this limit are indexed, the tree is dense and a single far away cell must not blow it up
+    static constexpr int MAX_BLOCK_ROWS = 1 << 16;
+
+    struct Totals {
+        double sum = 0;
+        double error = 0;
+        int64_t numbers = 0;
+        int64_t texts = 0;
+        int64_t formulas = 0;
+        int64_t nonFinite = 0;
+
+        void add(const Totals& other, int sign = 1) {
+            double term = sign * other.sum;
+            double total = sum + term;
+            double rounded = total - sum;
+            error += (sum - (total - rounded)) + (term - rounded) + sign * other.error;
+            sum = total;
+            numbers += sign * other.numbers;
+            texts += sign * other.texts;
+            formulas += sign * other.formulas;
+            nonFinite += sign * other.nonFinite;
+        }
+    };
+
+    void update(int blockRow, const Totals& delta) {
+        size_t needed = static_cast<size_t>(blockRow) + 1;
+        if (tree.size() <= needed) {
+            size_t capacity = std::max<size_t>(tree.size() - (tree.empty() ? 0 : 1), 1);
+            while (capacity < needed)
+                capacity *= 2;
+            grow(capacity);
+        }
+        for (size_t i = needed; i < tree.size(); i += i & (~i + 1)) {
+            tree[i].add(delta);
+        }
     }
-    std::set<std::pair<int, int>> getReferences() const override {
-        std::set<std::pair<int, int>> refs = exponent->getReferences();
-        const auto rightRefs = base->getReferences();
-        refs.insert(rightRefs.begin(), rightRefs.end());
-        return refs;
+
+    //Totals of the block rows firstBlockRow..lastBlockRow
+    Totals query(int firstBlockRow, int lastBlockRow) const {
+        Totals result = prefix(lastBlockRow + 1);
+        result.add(prefix(firstBlockRow), -1);
+        return result;
     }
 
+private:
+    //1-based tree whose capacity is a power of two
+    std::vector<Totals> tree;
 
+    Totals prefix(size_t blockRows) const {
+        Totals result;
+        for (size_t i = std::min(blockRows, tree.empty() ? 0 : tree.size() - 1); i > 0; i -= i & (~i + 1)) {
+            result.add(tree[i]);
+        }
+        return result;
+    }
 
+    //Doubling the capacity keeps all existing nodes, only the new root covers the old tree as a whole
+    void grow(size_t capacity) {
+        size_t oldCapacity = tree.empty() ? 0 : tree.size() - 1;
+        tree.resize(capacity + 1);
+        for (size_t size = std::max<size_t>(oldCapacity, 1) * 2; oldCapacity && size <= capacity; size *= 2) {
+            tree[size] = tree[size / 2];
+        }
+    }
 };
 
-class DivNode : public TreeNode {
-private:
-    std::shared_ptr<TreeNode> numerator;
-    std::shared_ptr<TreeNode> denominator;
 
+//Table of the distinct texts of a sheet. Sheets tend to repeat a small set of labels, so every text cell holds a
+//reference to the interned copy of its text instead of its own string, and counting a text compares pointers.
+//A text stays in the table while it is referenced, the unreferenced ones are freed when the table has doubled.
+class StringPool {
 public:
-    DivNode(std::shared_ptr<TreeNode> numerator, std::shared_ptr<TreeNode> denominator): numerator(numerator), denominator(denominator) {}
+    StringPool() = default;
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        auto lval = numerator->calculate(context);
-        auto rval = denominator->calculate(context);
+    StringPool(const StringPool&) = delete;
 
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            double denominatorValue = std::get<double>(rval);
-            if (denominatorValue == 0) {
-                return std::monostate();
-            }return std::get<double>(lval) / denominatorValue;
+    StringPool& operator=(const StringPool&) = delete;
+
+    ~StringPool() {
+        for (auto& [hash, entry] : strings) {
+            delete entry;
         }
-        return std::monostate();
     }
 
-    std::shared_ptr<TreeNode> clone() const override {
-        return std::make_shared<DivNode>(numerator->clone(), denominator->clone());
+    InternedString intern(std::string_view text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (InternedString existing = lookup(text))
+            return existing;
+        if (strings.size() >= sweepSize)
+            sweep();
+        auto* entry = new InternedText{{0}, std::string(text)};
+        strings.emplace(std::hash<std::string_view>()(text), entry);
+        return InternedString(entry);
     }
 
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<DivNode>(numerator->adjustReferences(rowOffset, colOffset), denominator->adjustReferences(rowOffset, colOffset));
-    }
-    std::string toString() const override {
-        return   "(" + numerator->toString() + "/" + denominator->toString() + ")";
+    //Returns the interned copy of text, or an empty reference when the text was never interned
+    InternedString find(std::string_view text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return lookup(text);
     }
-    std::set<std::pair<int, int>> getReferences() const override {
-        std::set<std::pair<int, int>> refs = numerator->getReferences();
-        const auto& rightRefs = denominator->getReferences();
-        refs.insert(rightRefs.begin(), rightRefs.end());
-        return refs;
+
+private:
+    std::mutex mutex;
+    std::unordered_multimap<size_t, InternedText*> strings;
+    size_t sweepSize = 1024;
+
+    //Texts are only referenced again through the table, under the lock, so a text without references is found here
+    //rather than interned twice
+    InternedString lookup(std::string_view text) {
+        auto [first, last] = strings.equal_range(std::hash<std::string_view>()(text));
+        for (auto it = first; it != last; ++it) {
+            if (it->second->text == text)
+                return InternedString(it->second);
+        }
+        return InternedString();
     }
 
+    void sweep() {
+        std::erase_if(strings, [](const auto& entry) {
+            if (entry.second->references.load(std::memory_order_acquire))
+                return false;
+            delete entry.second;
+            return true;
+        });
+        sweepSize = std::max<size_t>(1024, strings.size() * 2);
+    }
 };
 
-class ValueNode : public TreeNode {
-private:
-    CValue value;
 
+//Sparse storage of the spreadsheet cells. Cells live in dense 64x64 blocks that are found by a single hash lookup of
+//the block coordinates, the row and column then index the cell directly. Inside a block the cells are stored column by
+//column, so a column segment of a block is contiguous in memory.
+//Copies of a grid share the block table and the blocks: copying is O(1), the first write through a copy clones the
+//table of block pointers and then each block it writes to. Cells of a shared block are only written through the const
+//path when an evaluation caches its value, which is the same in all copies until one of them invalidates the cell.
+//The copies also share the string pool the text cells are interned in, it is released after the cells.
+class CellGrid {
 public:
-    explicit ValueNode(CValue val) : value(val) {}
+    static constexpr int BLOCK_BITS = 6;
+    static constexpr int BLOCK_SIZE = 1 << BLOCK_BITS;
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>>& context) const override {
-        return value;
+    CellGrid() : strings(std::make_shared<StringPool>()), data(std::make_shared<Data>()) {}
+
+    //There are no move operations, moving a grid copies the pointer to the shared data and keeps the source valid
+    CellGrid(const CellGrid& other) = default;
+
+    //The replaced cells may be the last references into the replaced pool, so they go first
+    CellGrid& operator=(const CellGrid& other) {
+        CellGrid copy(other);
+        std::swap(data, copy.data);
+        std::swap(strings, copy.strings);
+        return *this;
     }
 
-    std::shared_ptr<TreeNode> clone() const override {
-        return std::make_shared<ValueNode>(value);
+    //Returns the cell at cellId (row, column), or nullptr if the cell was never written
+    const Cell* find(const std::pair<int, int>& cellId) const {
+        auto it = data->blocks.find(blockKey(cellId));
+        if (it == data->blocks.end())
+            return nullptr;
+        size_t slot = slotIndex(cellId);
+        return it->second->used[slot] ? &it->second->cells[slot] : nullptr;
     }
 
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return clone();
+    //Returns the cell at cellId for writing, the block holding it is unshared first
+    Cell* find(const std::pair<int, int>& cellId) {
+        auto& blocks = mutableData().blocks;
+        auto it = blocks.find(blockKey(cellId));
+        if (it == blocks.end())
+            return nullptr;
+        size_t slot = slotIndex(cellId);
+        return it->second->used[slot] ? &unshare(it->second).cells[slot] : nullptr;
     }
-    std::string toString() const override {
-        if (std::holds_alternative<double>(value)) {
-            return std::to_string(std::get<double>(value));
-        } else if (std::holds_alternative<std::string>(value)) {
-            return  std::get<std::string>(value);
+
+    //Stores cell at cellId. The contents of a cell must only be changed here, so the numeric lanes stay in sync.
+    void assign(const std::pair<int, int>& cellId, Cell cell) {
+        Data& grid = mutableData();
+        auto& pointer = grid.blocks[blockKey(cellId)];
+        if (!pointer)
+            pointer = std::make_shared<Block>();
+        Block& block = unshare(pointer);
+        size_t slot = slotIndex(cellId);
+        if (!block.used[slot]) {
+            block.used[slot] = true;
+            grid.count++;
+        }
+        ColumnIndex::Totals delta = block.totals(slot);
+        block.cells[slot] = std::move(cell);
+        block.sync(slot);
+
+        int blockRow = cellId.first >> BLOCK_BITS;
+        if (blockRow >= 0 && blockRow < ColumnIndex::MAX_BLOCK_ROWS) {
+            ColumnIndex::Totals after = block.totals(slot);
+            after.add(delta, -1);
+            grid.columns[cellId.second].update(blockRow, after);
         }
-        return "";
     }
-    std::set<std::pair<int, int>> getReferences() const override {
-        return {};
+
+    //Aggregates all values of range into summary. Literal numbers are reduced straight from the contiguous numeric
+    //lane of every block column, only the formula cells are evaluated one by one. Without withExtremes the minimum
+    //and maximum are not needed, so the full blocks of tall ranges are answered by the column indexes instead.
+    void summarize(const CellRange& range, RangeSummary& summary, bool withExtremes = true) const {
+        if (!withExtremes && (range.to.first + 1) / BLOCK_SIZE - (range.from.first + BLOCK_SIZE - 1) / BLOCK_SIZE >= 2) {
+            summarizeIndexed(range, summary);
+            return;
+        }
+        forEachSegment(range, [&](const Block& block, int col, uint64_t rows, const std::pair<int, int>&) {
+            size_t base = col * BLOCK_SIZE;
+            summarizeNumbers(&block.numbers[base], block.numberMask[col] & rows, summary);
+            summary.values += std::popcount(block.textMask[col] & rows);
+            for (uint64_t formulas = block.formulaMask[col] & rows; formulas; formulas &= formulas - 1) {
+                summary.add(block.cells[base + std::countr_zero(formulas)].evaluate(*this));
+            }
+        });
     }
-};
 
-class ReferenceNode : public TreeNode {
-private:
-    std::pair<int, int> reference;
-    bool isRowAbsolute;
-    bool isColAbsolute;
-    int originRow;
-    int originCol;
+    //Counts the cells of range that evaluate to value. The text cells can only hold the interned copy of a text, so
+    //they are matched by pointer, and not at all when no cell holds the text.
+    double countValue(const CellRange& range, const CValue& value) const {
+        if (std::holds_alternative<std::monostate>(value)) {
+            RangeSummary summary;
+            summarize(range, summary, false);
+            return range.area() - summary.values;
+        }
 
-public:
-    ReferenceNode(int row, int col, bool rowAbs, bool colAbs, int origRow, int origCol)
-            : reference(row, col), isRowAbsolute(rowAbs), isColAbsolute(colAbs),
-              originRow(origRow), originCol(origCol) {}
+        InternedString text;
+        if (const std::string* string = std::get_if<std::string>(&value))
+            text = strings->find(*string);
+        size_t matches = 0;
+        forEachSegment(range, [&](const Block& block, int col, uint64_t rows, const std::pair<int, int>&) {
+            size_t base = col * BLOCK_SIZE;
+            if (std::holds_alternative<double>(value)) {
+                matches += countNumber(&block.numbers[base], block.numberMask[col] & rows, std::get<double>(value));
+            } else if (text) {
+                for (uint64_t texts = block.textMask[col] & rows; texts; texts &= texts - 1) {
+                    matches += *block.cells[base + std::countr_zero(texts)].getText() == text;
+                }
+            }
+            for (uint64_t formulas = block.formulaMask[col] & rows; formulas; formulas &= formulas - 1) {
+                matches += block.cells[base + std::countr_zero(formulas)].evaluate(*this) == value;
+            }
+        });
+        return static_cast<double>(matches);
+    }
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        auto it = context.find({reference.first, reference.second});
-        if (it != context.end() && it->second) {
-            return it->second->evaluate(context);
-        }
-        return std::monostate();
+    static uint64_t blockKey(const std::pair<int, int>& cellId) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(cellId.first >> BLOCK_BITS)) << 32)
+               | static_cast<uint32_t>(cellId.second >> BLOCK_BITS);
     }
-    std::shared_ptr<TreeNode> clone() const override{
-        return std::make_shared<ReferenceNode>(reference.first,reference.second, isRowAbsolute, isColAbsolute , originRow,originCol);
 
+    size_t size() const {
+        return data->count;
     }
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        int adjustedRow = isRowAbsolute ? reference.first : reference.first + rowOffset;
-        int adjustedCol = isColAbsolute ? reference.second : reference.second + colOffset;
-        return std::make_shared<ReferenceNode>(adjustedRow, adjustedCol, isRowAbsolute, isColAbsolute, originRow, originCol);
+
+    void clear() {
+        data = std::make_shared<Data>();
     }
 
-    std::string toString() const override {
-        return idToLabel(reference);
+    //Interns the text of a cell stored in this grid or its copies
+    InternedString intern(std::string_view text) const {
+        return strings->intern(text);
     }
 
-    std::string idToLabel(std::pair<int, int> cellId) const {
-        int col = cellId.second;
-        int row = cellId.first;
-        std::string label;
-        while (col > 0) {
-            int remainder = (col - 1) % 26;
-            label = char('A' + remainder) + label;
-            col = (col - 1) / 26;
-        }
-        label += std::to_string(row);
-        if (isColAbsolute) label.insert(0, "$");
-        if (isRowAbsolute) label.insert(label.begin() + (isColAbsolute ? 2 : 1), '$');
+    //Makes this empty grid intern into the table of other, so cells interned by either can be stored in both
+    void shareStrings(const CellGrid& other) {
+        strings = other.strings;
+    }
 
-        return label;
+    //Calls fn(cellId) for every formula cell of range. The block rows of tall ranges are bisected on the formula counts
+    //of the column indexes, so only the blocks that hold formulas are visited.
+    template <typename Fn>
+    void forEachFormula(const CellRange& range, Fn&& fn) const {
+        auto visit = [&](const CellRange& part) {
+            forEachSegment(part, [&](const Block& block, int col, uint64_t rows, const std::pair<int, int>& origin) {
+                for (uint64_t formulas = block.formulaMask[col] & rows; formulas; formulas &= formulas - 1) {
+                    fn(std::pair<int, int>(origin.first + std::countr_zero(formulas), origin.second + col));
+                }
+            });
+        };
+        int firstBlock = std::max(range.from.first, 0) >> BLOCK_BITS;
+        int lastBlock = std::min(range.to.first >> BLOCK_BITS, ColumnIndex::MAX_BLOCK_ROWS - 1);
+        if (lastBlock - firstBlock < 2) {
+            visit(range);
+            return;
+        }
+        if (range.from.first < 0)
+            visit(CellRange(range.from, {-1, range.to.second}));
+        if (range.to.first >= ColumnIndex::MAX_BLOCK_ROWS * BLOCK_SIZE)
+            visit(CellRange({ColumnIndex::MAX_BLOCK_ROWS * BLOCK_SIZE, range.from.second}, range.to));
+
+        auto visitColumn = [&](int col, const ColumnIndex& index) {
+            std::vector<std::pair<int, int>> spans = {{firstBlock, lastBlock}};
+            while (!spans.empty()) {
+                auto [low, high] = spans.back();
+                spans.pop_back();
+                if (!index.query(low, high).formulas)
+                    continue;
+                if (low == high) {
+                    visit(CellRange({std::max(range.from.first, low * BLOCK_SIZE), col},
+                                    {std::min(range.to.first, low * BLOCK_SIZE + BLOCK_SIZE - 1), col}));
+                    continue;
+                }
+                int middle = low + (high - low) / 2;
+                spans.emplace_back(middle + 1, high);
+                spans.emplace_back(low, middle);
+            }
+        };
+        if (static_cast<double>(range.to.second) - range.from.second + 1 > static_cast<double>(data->columns.size())) {
+            for (const auto& [col, index] : data->columns) {
+                if (col >= range.from.second && col <= range.to.second)
+                    visitColumn(col, index);
+            }
+            return;
+        }
+        for (int col = range.from.second; col <= range.to.second; col++) {
+            auto it = data->columns.find(col);
+            if (it != data->columns.end())
+                visitColumn(col, it->second);
+        }
     }
-    std::set<std::pair<int, int>> getReferences() const override {
-        return {reference};
+
+    //Visits all cells ordered by row and then by column, the iteration order of std::map<std::pair<row, column>, ...>
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        std::vector<std::pair<std::pair<int, int>, const Block*>> sorted;
+        sorted.reserve(data->blocks.size());
+        for (const auto& [key, block] : data->blocks) {
+            sorted.push_back({{static_cast<int>(key >> 32), static_cast<int>(key & 0xffffffffu)}, block.get()});
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        for (size_t first = 0; first < sorted.size();) {
+            size_t last = first;
+            while (last < sorted.size() && sorted[last].first.first == sorted[first].first.first)
+                last++;
+            for (int r = 0; r < BLOCK_SIZE; r++) {
+                for (size_t b = first; b < last; b++) {
+                    const Block* block = sorted[b].second;
+                    for (int c = 0; c < BLOCK_SIZE; c++) {
+                        size_t slot = c * BLOCK_SIZE + r;
+                        if (block->used[slot])
+                            fn(std::pair<int, int>(sorted[b].first.first * BLOCK_SIZE + r, sorted[b].first.second * BLOCK_SIZE + c), block->cells[slot]);
+                    }
+                }
+            }
+            first = last;
+        }
     }
-};
 
-class EqNode : public TreeNode {
 private:
-    std::shared_ptr<TreeNode> left;
-    std::shared_ptr<TreeNode> right;
+    //Besides the cells, a block keeps the literal numbers in a separate lane (0 in other slots) and, for every column,
+    //bit masks of the rows holding a literal number, a literal string or a formula
+    struct Block {
+        std::array<Cell, BLOCK_SIZE * BLOCK_SIZE> cells;
+        std::bitset<BLOCK_SIZE * BLOCK_SIZE> used;
+        std::array<double, BLOCK_SIZE * BLOCK_SIZE> numbers{};
+        std::array<uint64_t, BLOCK_SIZE> numberMask{};
+        std::array<uint64_t, BLOCK_SIZE> textMask{};
+        std::array<uint64_t, BLOCK_SIZE> formulaMask{};
+
+        void sync(size_t slot) {
+            size_t col = slot / BLOCK_SIZE;
+            uint64_t bit = uint64_t(1) << (slot % BLOCK_SIZE);
+            numberMask[col] &= ~bit;
+            textMask[col] &= ~bit;
+            formulaMask[col] &= ~bit;
+            numbers[slot] = 0;
+
+            const Cell& cell = cells[slot];
+            if (cell.getProgram()) {
+                formulaMask[col] |= bit;
+            } else if (const double* number = cell.getNumber()) {
+                numberMask[col] |= bit;
+                numbers[slot] = *number;
+            } else if (cell.getText()) {
+                textMask[col] |= bit;
+            }
+        }
 
-public:
-    EqNode(std::shared_ptr<TreeNode> lhs, std::shared_ptr<TreeNode> rhs)
-            : left(lhs), right(rhs) {}
+        //Contribution of a slot to the column index
+        ColumnIndex::Totals totals(size_t slot) const {
+            size_t col = slot / BLOCK_SIZE;
+            uint64_t bit = uint64_t(1) << (slot % BLOCK_SIZE);
+            ColumnIndex::Totals result;
+            if (numberMask[col] & bit) {
+                if (std::isfinite(numbers[slot])) {
+                    result.sum = numbers[slot];
+                    result.numbers = 1;
+                } else {
+                    result.nonFinite = 1;
+                }
+            } else if (textMask[col] & bit) {
+                result.texts = 1;
+            } else if (formulaMask[col] & bit) {
+                result.formulas = 1;
+            }
+            return result;
+        }
+    };
+
+    struct Data {
+        std::unordered_map<uint64_t, std::shared_ptr<Block>> blocks;
+        std::unordered_map<int, ColumnIndex> columns;
+        size_t count = 0;
+    };
+
+    //Declared first, so it is destroyed after the cells
+    std::shared_ptr<StringPool> strings;
+    std::shared_ptr<Data> data;
+
+    //A snapshot read by other threads (ConcurrentSpreadsheet) may have just released the data. The fence orders their
+    //reads before the writes that follow, use_count alone is a relaxed load.
+    Data& mutableData() {
+        if (data.use_count() > 1)
+            data = std::make_shared<Data>(*data);
+        else
+            std::atomic_thread_fence(std::memory_order_acquire);
+        return *data;
+    }
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        CValue lval = left->calculate(context);
-        CValue rval = right->calculate(context);
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) == std::get<double>(rval) ? 1.0 : 0.0;
+    static Block& unshare(std::shared_ptr<Block>& block) {
+        if (block.use_count() > 1)
+            block = std::make_shared<Block>(*block);
+        else
+            std::atomic_thread_fence(std::memory_order_acquire);
+        return *block;
+    }
+
+    //Sums a tall range column by column: the full blocks in the middle come from the column index, only the partial
+    //blocks at both ends and formulas in between are visited. The rows outside the indexed blocks are not in any
+    //column index, so they are scanned for the whole range like a short one.
+    void summarizeIndexed(const CellRange& range, RangeSummary& summary) const {
+        constexpr int indexedRows = ColumnIndex::MAX_BLOCK_ROWS * BLOCK_SIZE;
+        if (range.from.first < 0)
+            summarize(CellRange(range.from, {std::min(range.to.first, -1), range.to.second}), summary);
+        if (range.to.first >= indexedRows)
+            summarize(CellRange({std::max(range.from.first, indexedRows), range.from.second}, range.to), summary);
+        int fromRow = std::max(range.from.first, 0), toRow = std::min(range.to.first, indexedRows - 1);
+        if (fromRow > toRow)
+            return;
+        int firstFull = (fromRow + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int lastFull = (toRow + 1) / BLOCK_SIZE - 1;
+
+        auto summarizeColumn = [&](int col, const ColumnIndex& index) {
+            CellRange column({fromRow, col}, {toRow, col});
+            ColumnIndex::Totals totals = index.query(firstFull, lastFull);
+            if (totals.nonFinite || lastFull < firstFull) {
+                summarize(column, summary);
+                return;
+            }
+            summary.sum += totals.sum + totals.error;
+            summary.numbers += totals.numbers;
+            summary.values += totals.numbers + totals.texts;
+            if (firstFull * BLOCK_SIZE > fromRow)
+                summarize(CellRange({fromRow, col}, {firstFull * BLOCK_SIZE - 1, col}), summary);
+            if ((lastFull + 1) * BLOCK_SIZE <= toRow)
+                summarize(CellRange({(lastFull + 1) * BLOCK_SIZE, col}, {toRow, col}), summary);
+            if (!totals.formulas)
+                return;
+            for (int blockRow = firstFull; blockRow <= lastFull; blockRow++) {
+                auto it = data->blocks.find(blockKey({blockRow * BLOCK_SIZE, col}));
+                if (it == data->blocks.end())
+                    continue;
+                int colInBlock = col & (BLOCK_SIZE - 1);
+                for (uint64_t formulas = it->second->formulaMask[colInBlock]; formulas; formulas &= formulas - 1) {
+                    summary.add(it->second->cells[colInBlock * BLOCK_SIZE + std::countr_zero(formulas)].evaluate(*this));
+                }
+            }
+        };
+
+        if (static_cast<double>(range.to.second) - range.from.second + 1 > static_cast<double>(data->columns.size())) {
+            for (const auto& [col, index] : data->columns) {
+                if (col >= range.from.second && col <= range.to.second)
+                    summarizeColumn(col, index);
+            }
+            return;
         }
-        else if (std::holds_alternative<std::string>(lval) && std::holds_alternative<std::string>(rval)) {
-            return std::get<std::string>(lval) == std::get<std::string>(rval) ? 1.0 : 0.0;
+        for (int col = range.from.second; col <= range.to.second; col++) {
+            auto it = data->columns.find(col);
+            if (it != data->columns.end())
+                summarizeColumn(col, it->second);
         }
-        return std::monostate();
     }
 
-    std::shared_ptr<TreeNode> clone() const override {
-        return std::make_shared<EqNode>(left->clone(), right->clone());
+    //Calls fn(block, column in block, row mask, first cell of the block) for every column segment of range that lies in
+    //an existing block.
+    //When the range spans more blocks than the sheet has, the existing blocks are filtered instead.
+    template <typename Fn>
+    void forEachSegment(const CellRange& range, Fn&& fn) const {
+        int firstBlockRow = range.from.first >> BLOCK_BITS, lastBlockRow = range.to.first >> BLOCK_BITS;
+        int firstBlockCol = range.from.second >> BLOCK_BITS, lastBlockCol = range.to.second >> BLOCK_BITS;
+        auto visit = [&](int blockRow, int blockCol, const Block& block) {
+            int rowBase = blockRow * BLOCK_SIZE, colBase = blockCol * BLOCK_SIZE;
+            int firstRow = std::max(range.from.first, rowBase) - rowBase;
+            int lastRow = std::min(range.to.first, rowBase + BLOCK_SIZE - 1) - rowBase;
+            uint64_t rows = (~uint64_t(0) >> (BLOCK_SIZE - 1 - lastRow)) & (~uint64_t(0) << firstRow);
+            int lastCol = std::min(range.to.second, colBase + BLOCK_SIZE - 1) - colBase;
+            for (int col = std::max(range.from.second, colBase) - colBase; col <= lastCol; col++) {
+                fn(block, col, rows, std::pair<int, int>(rowBase, colBase));
+            }
+        };
+
+        double spannedBlocks = (static_cast<double>(lastBlockRow) - firstBlockRow + 1) * (static_cast<double>(lastBlockCol) - firstBlockCol + 1);
+        if (spannedBlocks > static_cast<double>(data->blocks.size())) {
+            for (const auto& [key, block] : data->blocks) {
+                int blockRow = static_cast<int>(key >> 32), blockCol = static_cast<int>(key & 0xffffffffu);
+                if (blockRow >= firstBlockRow && blockRow <= lastBlockRow && blockCol >= firstBlockCol && blockCol <= lastBlockCol)
+                    visit(blockRow, blockCol, *block);
+            }
+            return;
+        }
+        for (int blockCol = firstBlockCol; blockCol <= lastBlockCol; blockCol++) {
+            for (int blockRow = firstBlockRow; blockRow <= lastBlockRow; blockRow++) {
+                auto it = data->blocks.find(blockKey({blockRow * BLOCK_SIZE, blockCol * BLOCK_SIZE}));
+                if (it != data->blocks.end())
+                    visit(blockRow, blockCol, *it->second);
+            }
+        }
     }
 
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<EqNode>(left->adjustReferences(rowOffset, colOffset), right->adjustReferences(rowOffset, colOffset));
-    }
-    std::string toString() const override {
-        return  left->toString() + "==" + right->toString() ;
+    //Reduces the numbers of one block column selected by mask. Four independent lanes and branch free selects let the
+    //compiler turn the loop into SIMD code without reordering a single sequential sum.
+    static void summarizeNumbers(const double* numbers, uint64_t mask, RangeSummary& summary) {
+        if (!mask)
+            return;
+        constexpr double inf = std::numeric_limits<double>::infinity();
+        double sum[4] = {0, 0, 0, 0};
+        double low[4] = {inf, inf, inf, inf};
+        double high[4] = {-inf, -inf, -inf, -inf};
+        for (int i = 0; i < BLOCK_SIZE; i += 4) {
+            for (int lane = 0; lane < 4; lane++) {
+                bool present = (mask >> (i + lane)) & 1;
+                double number = numbers[i + lane];
+                sum[lane] += present ? number : 0.0;
+                low[lane] = std::min(low[lane], present ? number : inf);
+                high[lane] = std::max(high[lane], present ? number : -inf);
+            }
+        }
+        summary.sum += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+        summary.min = std::min({summary.min, low[0], low[1], low[2], low[3]});
+        summary.max = std::max({summary.max, high[0], high[1], high[2], high[3]});
+        summary.numbers += std::popcount(mask);
+        summary.values += std::popcount(mask);
     }
-    std::set<std::pair<int, int>> getReferences() const override {
-        std::set<std::pair<int, int>> refs = left->getReferences();
-        const auto rightRefs = right->getReferences();
-        refs.insert(rightRefs.begin(), rightRefs.end());
-        return refs;
+
+    static size_t countNumber(const double* numbers, uint64_t mask, double value) {
+        size_t matches = 0;
+        for (int i = 0; i < BLOCK_SIZE; i++) {
+            matches += ((mask >> i) & 1) & (numbers[i] == value);
+        }
+        return matches;
     }
 
+    static size_t slotIndex(const std::pair<int, int>& cellId) {
+        return (cellId.second & (BLOCK_SIZE - 1)) * BLOCK_SIZE + (cellId.first & (BLOCK_SIZE - 1));
+    }
 };
 
-class LtNode : public TreeNode {
-private:
-    std::shared_ptr<TreeNode> left;
-    std::shared_ptr<TreeNode> right;
 
+//Appends the textual form of a (row, column) cell id to out, e.g. $AB7
+void appendCellLabel(std::string& out, std::pair<int, int> cellId, bool isRowAbsolute, bool isColAbsolute) {
+    char label[16];
+    char* start = label + sizeof(label);
+    for (int col = cellId.second; col > 0; col = (col - 1) / 26) {
+        *--start = static_cast<char>('A' + (col - 1) % 26);
+    }
+    if (isColAbsolute)
+        out += '$';
+    out.append(start, label + sizeof(label));
+    if (isRowAbsolute)
+        out += '$';
+    auto [end, ec] = std::to_chars(label, label + sizeof(label), cellId.first);
+    out.append(label, end);
+}
+
+//Compiled expression: a flat array of postfix instructions evaluated on a value stack, with the numbers, strings,
+//references and ranges it uses kept in pools indexed by the instruction argument. The branches of if() are compiled
+//with jumps, so only the taken branch is evaluated. The instructions and all the pools share a single allocation, so
+//building, copying or freeing a program is one allocation whatever the size of the expression.
+//Relative references are stored as offsets from the anchor, the cell holding the formula, like R1C1 notation. A
+//formula copied to another cell therefore compiles to the same program, and cells share equal programs (ProgramPool).
+class Program {
 public:
-    LtNode(std::shared_ptr<TreeNode> lhs, std::shared_ptr<TreeNode> rhs)
-            : left(lhs), right(rhs) {}
+    enum class OpCode : uint8_t {
+        Number, String, Reference,
+        Add, Sub, Mul, Div, Pow, Neg,
+        Eq, Ne, Lt, Le, Gt, Ge,
+        Sum, Min, Max, Count, CountVal,
+        //Pops the condition of if(), arg is the distance to the false branch, preceded by the Jump over it
+        Test,
+        Jump
+    };
+
+    struct Instruction {
+        OpCode op;
+        uint32_t arg;
+    };
+
+    //The row and column of cell are absolute, or offsets from the anchor when the reference is relative
+    struct Reference {
+        std::pair<int, int> cell;
+        bool isRowAbsolute;
+        bool isColAbsolute;
+
+        std::pair<int, int> resolve(const std::pair<int, int>& anchor) const {
+            return {isRowAbsolute ? cell.first : anchor.first + cell.first,
+                    isColAbsolute ? cell.second : anchor.second + cell.second};
+        }
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        CValue lval = left->calculate(context);
-        CValue rval = right->calculate(context);
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) < std::get<double>(rval) ? 1.0 : 0.0;
+        void write(std::string& out, const std::pair<int, int>& anchor) const {
+            appendCellLabel(out, resolve(anchor), isRowAbsolute, isColAbsolute);
         }
-        else if (std::holds_alternative<std::string>(lval) && std::holds_alternative<std::string>(rval)) {
-            return std::get<std::string>(lval) < std::get<std::string>(rval) ? 1.0 : 0.0;
+
+        bool operator==(const Reference& other) const = default;
+    };
+
+    struct Range {
+        Reference from;
+        Reference to;
+
+        CellRange cells(const std::pair<int, int>& anchor) const {
+            return CellRange(from.resolve(anchor), to.resolve(anchor));
         }
 
-        return std::monostate();
-    }
+        bool operator==(const Range& other) const = default;
+    };
 
-    std::shared_ptr<TreeNode> clone() const override {
-        return std::make_shared<LtNode>(left->clone(), right->clone());
+    Program(const Program& other) : layout(other.layout), storage(new std::byte[layout.size]) {
+        if (layout.size)
+            std::memcpy(storage.get(), other.storage.get(), layout.size);
     }
 
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<LtNode>(left->adjustReferences(rowOffset, colOffset), right->adjustReferences(rowOffset, colOffset));
-    }
-    std::string toString() const override {
-        return  left->toString() + "<" + right->toString() ;
+    Program& operator=(const Program& other) {
+        Program copy(other);
+        std::swap(layout, copy.layout);
+        std::swap(storage, copy.storage);
+        return *this;
     }
-    std::set<std::pair<int, int>> getReferences() const override {
-        std::set<std::pair<int, int>> refs = left->getReferences();
-        const auto rightRefs = right->getReferences();
-        refs.insert(rightRefs.begin(), rightRefs.end());
+
+    //Evaluates the program of the cell at anchor
+    CValue run(const CellGrid& context, const std::pair<int, int>& anchor) const;
+
+    //Decompiles the program of the cell at anchor into expression text (without the leading '='), parenthesized only
+    //where needed, and appends it to out
+    void write(std::string& out, const std::pair<int, int>& anchor) const;
+
+    std::set<std::pair<int, int>> getReferences(const std::pair<int, int>& anchor) const {
+        std::set<std::pair<int, int>> refs;
+        for (const auto& ref : references()) {
+            refs.insert(ref.resolve(anchor));
+        }
         return refs;
     }
 
-};
-
-class LeNode : public TreeNode {
-private:
-    std::shared_ptr<TreeNode> left;
-    std::shared_ptr<TreeNode> right;
+    std::vector<CellRange> getRanges(const std::pair<int, int>& anchor) const {
+        std::vector<CellRange> cellRanges;
+        cellRanges.reserve(layout.rangeCount);
+        for (const auto& range : ranges()) {
+            cellRanges.push_back(range.cells(anchor));
+        }
+        return cellRanges;
+    }
 
-public:
-    LeNode(std::shared_ptr<TreeNode> lhs, std::shared_ptr<TreeNode> rhs)
-            : left(lhs), right(rhs) {}
+    //Programs are equal when they compute the same expression relative to their anchors
+    bool operator==(const Program& other) const {
+        auto equal = [](auto first, auto second) { return std::equal(first.begin(), first.end(), second.begin(), second.end()); };
+        if (layout.sliceCount != other.layout.sliceCount || !equal(numbers(), other.numbers()) ||
+            !equal(references(), other.references()) || !equal(ranges(), other.ranges()))
+            return false;
+        if (!std::equal(code().begin(), code().end(), other.code().begin(), other.code().end(),
+                        [](const Instruction& a, const Instruction& b) { return a.op == b.op && a.arg == b.arg; }))
+            return false;
+        for (uint32_t i = 0; i < layout.sliceCount; i++) {
+            if (string(i) != other.string(i))
+                return false;
+        }
+        return true;
+    }
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        CValue lval = left->calculate(context);
-        CValue rval = right->calculate(context);
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) <= std::get<double>(rval) ? 1.0 : 0.0;
+    size_t hash() const {
+        size_t seed = layout.size;
+        auto mix = [&seed](uint64_t value) {
+            seed ^= value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2);
+        };
+        for (const auto& ins : code()) {
+            mix((static_cast<uint64_t>(ins.op) << 32) | ins.arg);
         }
-        else if (std::holds_alternative<std::string>(lval) && std::holds_alternative<std::string>(rval)) {
-            return std::get<std::string>(lval) <= std::get<std::string>(rval) ? 1.0 : 0.0;
+        for (const auto& ref : references()) {
+            mix((static_cast<uint64_t>(static_cast<uint32_t>(ref.cell.first)) << 32) | static_cast<uint32_t>(ref.cell.second));
         }
-        return std::monostate();
+        for (const auto& range : ranges()) {
+            mix((static_cast<uint64_t>(static_cast<uint32_t>(range.from.cell.first)) << 32) | static_cast<uint32_t>(range.to.cell.first));
+            mix((static_cast<uint64_t>(static_cast<uint32_t>(range.from.cell.second)) << 32) | static_cast<uint32_t>(range.to.cell.second));
+        }
+        //Formulas often differ only in their constants
+        for (double number : numbers()) {
+            mix(std::bit_cast<uint64_t>(number));
+        }
+        for (uint32_t i = 0; i < layout.sliceCount; i++) {
+            mix(std::hash<std::string_view>()(string(i)));
+        }
+        return seed;
     }
 
-    std::shared_ptr<TreeNode> clone() const override {
-        return std::make_shared<LeNode>(left->clone(), right->clone());
+    //Pooled references and ranges in the order they appear in the expression
+    std::span<const Reference> references() const {
+        return pool<const Reference>(layout.references, layout.referenceCount);
     }
 
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<LeNode>(left->adjustReferences(rowOffset, colOffset), right->adjustReferences(rowOffset, colOffset));
+    std::span<const Range> ranges() const {
+        return pool<const Range>(layout.ranges, layout.rangeCount);
     }
-    std::string toString() const override {
-        return  left->toString() + "<=" + right->toString() ;
+
+    //The serialized program is its layout followed by its storage, which holds offsets but no pointers
+    size_t serializedSize() const {
+        return sizeof(Layout) + layout.size;
     }
-    std::set<std::pair<int, int>> getReferences() const override {
-        std::set<std::pair<int, int>> refs = left->getReferences();
-        const auto rightRefs = right->getReferences();
-        refs.insert(rightRefs.begin(), rightRefs.end());
-        return refs;
+
+    void serialize(std::byte* out) const {
+        std::memcpy(out, &layout, sizeof(Layout));
+        if (layout.size)
+            std::memcpy(out + sizeof(Layout), storage.get(), layout.size);
     }
 
-};
+    //Rebuilds a serialized program, bytes may be padded past its end. Returns nullptr when they do not form a valid program
+    static std::shared_ptr<Program> deserialize(std::span<const std::byte> bytes);
 
-class GtNode : public TreeNode {
 private:
-    std::shared_ptr<TreeNode> left;
-    std::shared_ptr<TreeNode> right;
-
-public:
-    GtNode(std::shared_ptr<TreeNode> lhs, std::shared_ptr<TreeNode> rhs)
-            : left(lhs), right(rhs) {}
-
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        CValue lval = left->calculate(context);
-        CValue rval = right->calculate(context);
-        if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) > std::get<double>(rval) ? 1.0 : 0.0;
+    friend class TreeBuilder;
+
+    //Position of a string in the character pool
+    struct Slice {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    //Byte offsets and lengths of the pools inside storage, the pools with the strictest alignment come first
+    struct Layout {
+        uint32_t numbers = 0, numberCount = 0;
+        uint32_t code = 0, codeSize = 0;
+        uint32_t references = 0, referenceCount = 0;
+        uint32_t ranges = 0, rangeCount = 0;
+        uint32_t slices = 0, sliceCount = 0;
+        uint32_t chars = 0, size = 0;
+    };
+
+    Layout layout;
+    std::unique_ptr<std::byte[]> storage;
+
+    Program() = default;
+
+    //Checks that the pools fit the storage and that the code only indexes its pools, jumps forward and leaves a single
+    //value on the stack, so a deserialized program cannot make run read out of bounds
+    bool valid() const;
+
+    //The strings come as slices of one character buffer, their offsets relative to its start
+    Program(const std::vector<Instruction>& code, const std::vector<double>& numbers, const std::vector<Slice>& strings,
+            std::string_view characters, const std::vector<Reference>& references, const std::vector<Range>& ranges) {
+        size_t offset = 0;
+        auto place = [&offset](uint32_t& start, uint32_t& count, size_t size, size_t itemSize) {
+            start = static_cast<uint32_t>(offset);
+            count = static_cast<uint32_t>(size);
+            offset += size * itemSize;
+        };
+        place(layout.numbers, layout.numberCount, numbers.size(), sizeof(double));
+        place(layout.code, layout.codeSize, code.size(), sizeof(Instruction));
+        place(layout.references, layout.referenceCount, references.size(), sizeof(Reference));
+        place(layout.ranges, layout.rangeCount, ranges.size(), sizeof(Range));
+        place(layout.slices, layout.sliceCount, strings.size(), sizeof(Slice));
+        layout.chars = static_cast<uint32_t>(offset);
+        layout.size = static_cast<uint32_t>(offset + characters.size());
+
+        //The storage is zeroed and the structs are copied member by member, so their padding stays zero and a saved
+        //program is the same bytes every time
+        storage.reset(new std::byte[layout.size]());
+        auto put = [this](uint32_t offset, const void* data, size_t bytes) {
+            if (bytes)
+                std::memcpy(storage.get() + offset, data, bytes);
+        };
+        put(layout.numbers, numbers.data(), numbers.size() * sizeof(double));
+        auto instructions = pool<Instruction>(layout.code, layout.codeSize);
+        for (size_t i = 0; i < code.size(); i++) {
+            instructions[i].op = code[i].op;
+            instructions[i].arg = code[i].arg;
         }
-        else if (std::holds_alternative<std::string>(lval) && std::holds_alternative<std::string>(rval)) {
-            return std::get<std::string>(lval) > std::get<std::string>(rval) ? 1.0 : 0.0;
+        auto copyReference = [](Reference& to, const Reference& from) {
+            to.cell = from.cell;
+            to.isRowAbsolute = from.isRowAbsolute;
+            to.isColAbsolute = from.isColAbsolute;
+        };
+        auto referencePool = pool<Reference>(layout.references, layout.referenceCount);
+        for (size_t i = 0; i < references.size(); i++) {
+            copyReference(referencePool[i], references[i]);
         }
-        return std::monostate();
+        auto rangePool = pool<Range>(layout.ranges, layout.rangeCount);
+        for (size_t i = 0; i < ranges.size(); i++) {
+            copyReference(rangePool[i].from, ranges[i].from);
+            copyReference(rangePool[i].to, ranges[i].to);
+        }
+        auto slices = pool<Slice>(layout.slices, layout.sliceCount);
+        for (size_t i = 0; i < strings.size(); i++) {
+            slices[i] = {layout.chars + strings[i].offset, strings[i].length};
+        }
+        put(layout.chars, characters.data(), characters.size());
     }
 
-    std::shared_ptr<TreeNode> clone() const override {
-        return std::make_shared<GtNode>(left->clone(), right->clone());
+    template <typename T>
+    std::span<T> pool(uint32_t offset, uint32_t count) const {
+        return {reinterpret_cast<T*>(storage.get() + offset), count};
     }
 
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<GtNode>(left->adjustReferences(rowOffset, colOffset), right->adjustReferences(rowOffset, colOffset));
+    std::span<const Instruction> code() const {
+        return pool<const Instruction>(layout.code, layout.codeSize);
     }
-    std::string toString() const override {
-        return  left->toString() + ">" + right->toString() ;
-    }
-    std::set<std::pair<int, int>> getReferences() const override {
-        std::set<std::pair<int, int>> refs = left->getReferences();
-        const auto rightRefs = right->getReferences();
-        refs.insert(rightRefs.begin(), rightRefs.end());
-        return refs;
-    }
-
-};
 
-class GeNode : public TreeNode {
-private:
-    std::shared_ptr<TreeNode> left;
-    std::shared_ptr<TreeNode> right;
+    std::span<const double> numbers() const {
+        return pool<const double>(layout.numbers, layout.numberCount);
+    }
 
-public:
-    GeNode(std::shared_ptr<TreeNode> lhs, std::shared_ptr<TreeNode> rhs)
-            : left(lhs), right(rhs) {}
+    std::string_view string(uint32_t index) const {
+        Slice slice = pool<const Slice>(layout.slices, layout.sliceCount)[index];
+        return {reinterpret_cast<const char*>(storage.get()) + slice.offset, slice.length};
+    }
 
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        CValue lval = left->calculate(context);
-        CValue rval = right->calculate(context);
+    static CValue add(const CValue& lval, const CValue& rval) {
         if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) >= std::get<double>(rval) ? 1.0 : 0.0;
+            return std::get<double>(lval) + std::get<double>(rval);
         }
-        else if (std::holds_alternative<std::string>(lval) && std::holds_alternative<std::string>(rval)) {
-            return std::get<std::string>(lval) >= std::get<std::string>(rval) ? 1.0 : 0.0;
+        if (std::holds_alternative<std::monostate>(lval) || std::holds_alternative<std::monostate>(rval)) {
+            return std::monostate();
         }
-        return std::monostate();
+        std::string result = std::holds_alternative<std::string>(lval) ? std::get<std::string>(lval) : std::to_string(std::get<double>(lval));
+        result += std::holds_alternative<std::string>(rval) ? std::get<std::string>(rval) : std::to_string(std::get<double>(rval));
+        return result;
     }
 
-    std::shared_ptr<TreeNode> clone() const override {
-        return std::make_shared<GeNode>(left->clone(), right->clone());
+    static CValue arithmetic(OpCode op, const CValue& lval, const CValue& rval) {
+        if (!std::holds_alternative<double>(lval) || !std::holds_alternative<double>(rval)) {
+            return std::monostate();
+        }
+        double left = std::get<double>(lval);
+        double right = std::get<double>(rval);
+        switch (op) {
+            case OpCode::Sub:
+                return left - right;
+            case OpCode::Mul:
+                return left * right;
+            case OpCode::Div:
+                if (right == 0) {
+                    return std::monostate();
+                }
+                return left / right;
+            default:
+                return std::pow(left, right);
+        }
     }
 
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<GeNode>(left->adjustReferences(rowOffset, colOffset), right->adjustReferences(rowOffset, colOffset));
-    }
-    std::string toString() const override {
-        return  left->toString() + ">=" + right->toString() ;
-    }
-    std::set<std::pair<int, int>> getReferences() const override {
-        std::set<std::pair<int, int>> refs = left->getReferences();
-        const auto rightRefs = right->getReferences();
-        refs.insert(rightRefs.begin(), rightRefs.end());
-        return refs;
+    template <typename T>
+    static bool compare(OpCode op, const T& left, const T& right) {
+        switch (op) {
+            case OpCode::Eq:
+                return left == right;
+            case OpCode::Ne:
+                return left != right;
+            case OpCode::Lt:
+                return left < right;
+            case OpCode::Le:
+                return left <= right;
+            case OpCode::Gt:
+                return left > right;
+            default:
+                return left >= right;
+        }
     }
 
-};
-
-class NeNode : public TreeNode {
-private:
-    std::shared_ptr<TreeNode> left;
-    std::shared_ptr<TreeNode> right;
-
-public:
-    NeNode(std::shared_ptr<TreeNode> lhs, std::shared_ptr<TreeNode> rhs)
-            : left(lhs), right(std::move(rhs)) {}
-
-    CValue calculate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>> &context) const override {
-        CValue lval = left->calculate(context);
-        CValue rval = right->calculate(context);
+    static CValue compare(OpCode op, const CValue& lval, const CValue& rval) {
         if (std::holds_alternative<double>(lval) && std::holds_alternative<double>(rval)) {
-            return std::get<double>(lval) != std::get<double>(rval) ? 1.0 : 0.0;
+            return compare(op, std::get<double>(lval), std::get<double>(rval)) ? 1.0 : 0.0;
         }
-        else if (std::holds_alternative<std::string>(lval) && std::holds_alternative<std::string>(rval)) {
-            return std::get<std::string>(lval) != std::get<std::string>(rval) ? 1.0 : 0.0;
+        if (std::holds_alternative<std::string>(lval) && std::holds_alternative<std::string>(rval)) {
+            return compare(op, std::get<std::string>(lval), std::get<std::string>(rval)) ? 1.0 : 0.0;
         }
         return std::monostate();
     }
+};
 
-    std::shared_ptr<TreeNode> clone() const override {
-        return std::make_shared<NeNode>(left->clone(), right->clone());
-    }
 
-    std::shared_ptr<TreeNode> adjustReferences(int rowOffset, int colOffset) const override {
-        return std::make_shared<NeNode>(left->adjustReferences(rowOffset, colOffset), right->adjustReferences(rowOffset, colOffset));
+//Cell reference decoded by the parser, e.g. $AB7 is row 7, column 28 with an absolute column
+struct CellReference {
+    int row = 0;
+    int col = 0;
+    bool isRowAbsolute = false;
+    bool isColAbsolute = false;
+};
+
+//Decodes a reference [$]letters[$]digits starting at pos, pos is moved past it. Returns false and leaves pos unchanged
+//if there is no reference at pos, or if its row or column does not fit an int
+bool decodeReference(std::string_view text, size_t& pos, CellReference& ref) {
+    size_t idx = pos;
+    ref = CellReference();
+    if (idx < text.size() && text[idx] == '$') {
+        ref.isColAbsolute = true;
+        idx++;
     }
-    std::string toString() const override {
-        return  left->toString() + "!=" + right->toString() ;
+    size_t letters = idx;
+    long long col = 0;
+    while (idx < text.size() && std::isalpha(static_cast<unsigned char>(text[idx]))) {
+        col = col * 26 + (std::toupper(static_cast<unsigned char>(text[idx++])) - 'A' + 1);
+        if (col > std::numeric_limits<int>::max())
+            return false;
     }
-    std::set<std::pair<int, int>> getReferences() const override {
-        std::set<std::pair<int, int>> refs = left->getReferences();
-        const auto rightRefs = right->getReferences();
-        refs.insert(rightRefs.begin(), rightRefs.end());
-        return refs;
+    if (idx == letters)
+        return false;
+    if (idx < text.size() && text[idx] == '$') {
+        ref.isRowAbsolute = true;
+        idx++;
     }
+    if (idx >= text.size() || !std::isdigit(static_cast<unsigned char>(text[idx])))
+        return false;
+    auto [end, ec] = std::from_chars(text.data() + idx, text.data() + text.size(), ref.row);
+    if (ec != std::errc())
+        return false;
+    ref.col = static_cast<int>(col);
+    pos = end - text.data();
+    return true;
+}
 
-
+//Builder interface of ExpressionParser. Like CExprBuilder it receives the expression in postfix order, but the tokens
+//are views into the parsed text and the references arrive decoded, so building a formula copies no token.
+class CTokenBuilder {
+public:
+    virtual ~CTokenBuilder() = default;
+    virtual void opAdd() = 0;
+    virtual void opSub() = 0;
+    virtual void opMul() = 0;
+    virtual void opDiv() = 0;
+    virtual void opPow() = 0;
+    virtual void opNeg() = 0;
+    virtual void opEq() = 0;
+    virtual void opNe() = 0;
+    virtual void opLt() = 0;
+    virtual void opLe() = 0;
+    virtual void opGt() = 0;
+    virtual void opGe() = 0;
+    virtual void valNumber(double val) = 0;
+    //The value of the literal, with its doubled quotes already collapsed
+    virtual void valString(std::string_view val) = 0;
+    virtual void valReference(const CellReference& ref) = 0;
+    virtual void valRange(const CellReference& from, const CellReference& to) = 0;
+    //fnName is in lower case
+    virtual void funcCall(std::string_view fnName, int paramCount) = 0;
 };
 
 
+//Class to build the expression, compiles the postfix callbacks of the parser into a Program. It implements both the
+//CExprBuilder interface of the attached parser and the allocation free CTokenBuilder used by ExpressionParser.
+class TreeBuilder : public CExprBuilder, public CTokenBuilder {
 
-//Class to build the expression
-class TreeBuilder : public CExprBuilder {
-
-private:
-    std::stack<std::shared_ptr<TreeNode>> nodes;
 public:
+    TreeBuilder() = default;
+
+    //anchor is the cell the expression is written to, its relative references are compiled as offsets from it
+    explicit TreeBuilder(const std::pair<int, int>& anchor) : anchor(anchor) {}
+
+    //Starts a new expression written to anchor, the pools keep their capacity so a reused builder does not allocate
+    void reset(const std::pair<int, int>& cell) {
+        anchor = cell;
+        code.clear();
+        numbers.clear();
+        slices.clear();
+        characters.clear();
+        references.clear();
+        ranges.clear();
+        operands.clear();
+    }
 
     void opAdd() override {
-        auto right = popNode();
-        auto left = popNode();
-        nodes.push(std::make_shared<AddNode>(left, right));
-
+        binary(Program::OpCode::Add);
     }
 
     void valNumber(double val) override {
-        nodes.push(std::make_shared<ValueNode>(val));
-
+        operands.push_back({code.size(), -1, true});
+        emit(Program::OpCode::Number, numbers.size());
+        numbers.push_back(val);
     }
 
     void valString(std::string val) override {
-        nodes.push(std::make_shared<ValueNode>(val));
+        valString(std::string_view(val));
+    }
+
+    void valString(std::string_view val) override {
+        operands.push_back({code.size()});
+        emit(Program::OpCode::String, slices.size());
+        slices.push_back({static_cast<uint32_t>(characters.size()), static_cast<uint32_t>(val.size())});
+        characters.append(val);
     }
 
     void opSub() override {
-        auto right = popNode();
-        auto left = popNode();
-        nodes.push(std::make_shared<SubNode>(left, right));
+        binary(Program::OpCode::Sub);
     }
 
     void opMul() override {
-        auto right = popNode();
-        auto left = popNode();
-        nodes.push(std::make_shared<MulNode>(left, right));
-
-
+        binary(Program::OpCode::Mul);
     }
 
     void opDiv() override {
-        auto denominator = popNode();
-        auto numerator = popNode();
-        nodes.push(std::make_shared<DivNode>(numerator, denominator));
+        binary(Program::OpCode::Div);
     }
 
     void opPow() override {
-        auto exponent = popNode();
-        auto base = popNode();
-        nodes.push(std::make_shared<PowerNode>(base, exponent));
+        binary(Program::OpCode::Pow);
     }
 
     void opNeg() override {
-        auto operand = popNode();
-        nodes.push(std::make_shared<NegNode>(operand));
+        Operand operand = popOperand();
+        if (isLiteral(operand.start, code.size()) && code.back().op == Program::OpCode::Number) {
+            double number = numbers.back();
+            dropLiteral();
+            valNumber(-number);
+            return;
+        }
+        //-(-x) is x when x is a number or undefined, a text would turn undefined
+        if (operand.negatesNumber) {
+            code.pop_back();
+            operands.push_back({operand.start, -1, true});
+            return;
+        }
+        operands.push_back({operand.start, -1, true, operand.numeric});
+        emit(Program::OpCode::Neg, 0);
     }
 
     void opEq() override {
-        auto right = popNode();
-        auto left = popNode();
-        nodes.push(std::make_shared<EqNode>(left, right));
+        binary(Program::OpCode::Eq);
     }
 
     void opNe() override {
-        auto right = popNode();
-        auto left = popNode();
-        nodes.push(std::make_shared<NeNode>(left, right));
+        binary(Program::OpCode::Ne);
     }
 
     void opLt() override {
-        auto right = popNode();
-        auto left = popNode();
-        nodes.push(std::make_shared<LtNode>(left, right));
+        binary(Program::OpCode::Lt);
     }
 
     void opLe() override {
-        auto right = popNode();
-        auto left = popNode();
-        nodes.push(std::make_shared<LeNode>(left, right));
+        binary(Program::OpCode::Le);
     }
 
     void opGt() override {
-        auto right = popNode();
-        auto left = popNode();
-        nodes.push(std::make_shared<GtNode>(left, right));
+        binary(Program::OpCode::Gt);
+    }
+
+    void opGe() override {
+        binary(Program::OpCode::Ge);
+    }
+
+    void valReference(std::string val) override {
+        CellReference ref;
+        size_t idx = 0;
+        if (!decodeReference(val, idx, ref) || idx != val.size())
+            throw std::invalid_argument("Invalid reference " + val);
+        valReference(ref);
+    }
+
+    void valReference(const CellReference& ref) override {
+        operands.push_back({code.size()});
+        emit(Program::OpCode::Reference, references.size());
+        references.push_back(relativize(ref));
+    }
+
+    void valRange(std::string val) override {
+        CellReference from, to;
+        size_t idx = 0;
+        if (!decodeReference(val, idx, from) || idx >= val.size() || val[idx++] != ':' ||
+            !decodeReference(val, idx, to) || idx != val.size())
+            throw std::invalid_argument("Invalid range " + val);
+        valRange(from, to);
+    }
+
+    //A range is not a value on its own, it only becomes the argument of the function consuming it
+    void valRange(const CellReference& from, const CellReference& to) override {
+        operands.push_back({code.size(), static_cast<int>(ranges.size())});
+        ranges.push_back({relativize(from), relativize(to)});
+    }
+
+    void funcCall(std::string fnName, int paramCount) override {
+        std::transform(fnName.begin(), fnName.end(), fnName.begin(), [](unsigned char ch) { return std::tolower(ch); });
+        funcCall(std::string_view(fnName), paramCount);
+    }
+
+    void funcCall(std::string_view fnName, [[maybe_unused]] int paramCount) override {
+        if (fnName == "if") {
+            Operand ifFalse = popOperand();
+            Operand ifTrue = popOperand();
+            Operand condition = popOperand();
+            //cond Test(->false) true Jump(->end) false
+            size_t end = code.size();
+            code.insert(code.begin() + ifFalse.start, {Program::OpCode::Jump, static_cast<uint32_t>(end + 1 - ifFalse.start)});
+            code.insert(code.begin() + ifTrue.start, {Program::OpCode::Test, static_cast<uint32_t>(ifFalse.start + 2 - ifTrue.start)});
+            //The result is either branch and ends with the code of the false one, so nothing is known about it
+            operands.push_back({condition.start});
+        } else if (fnName == "countval") {
+            int range = popRange();
+            operands.push_back({popOperand().start, -1, true});
+            emit(Program::OpCode::CountVal, range);
+        } else if (fnName == "sum") {
+            function(Program::OpCode::Sum);
+        } else if (fnName == "min") {
+            function(Program::OpCode::Min);
+        } else if (fnName == "max") {
+            function(Program::OpCode::Max);
+        } else if (fnName == "count") {
+            function(Program::OpCode::Count);
+        } else {
+            throw std::invalid_argument("Unknown function " + std::string(fnName));
+        }
+    }
+
+    std::shared_ptr<Program> getProgram() {
+        if (operands.size() != 1 || operands.back().range >= 0)
+            throw std::invalid_argument("Invalid expression.");
+        auto program = std::shared_ptr<Program>(new Program(code, numbers, slices, characters, references, ranges));
+        assert (program->valid());
+        return program;
+    }
+
+private:
+    //Value on the builder stack: where its instructions start, or the pooled range when it is a range argument.
+    //numeric tells the value is a number or undefined, never a text, negatesNumber that it is -x for such an x.
+    struct Operand {
+        size_t start;
+        int range = -1;
+        bool numeric = false;
+        bool negatesNumber = false;
+    };
+
+    std::pair<int, int> anchor;
+    //Pools of the program being built, copied into its single allocation by getProgram
+    std::vector<Program::Instruction> code;
+    std::vector<double> numbers;
+    std::vector<Program::Slice> slices;
+    std::string characters;
+    std::vector<Program::Reference> references;
+    std::vector<Program::Range> ranges;
+    std::vector<Operand> operands;
+
+    Program::Reference relativize(const CellReference& ref) const {
+        return {{ref.isRowAbsolute ? ref.row : ref.row - anchor.first, ref.isColAbsolute ? ref.col : ref.col - anchor.second},
+                ref.isRowAbsolute, ref.isColAbsolute};
+    }
+
+    void emit(Program::OpCode op, size_t arg) {
+        code.push_back({op, static_cast<uint32_t>(arg)});
+    }
+
+    //Operations on literals are evaluated here, unless the result is undefined or not finite, which no literal can
+    //express. x*1, 1*x, x/1, x-0 and x^1 are reduced to x when x is a number or undefined. Other identities do not
+    //hold for texts or for -0, e.g. x+0 concatenates a text.
+    void binary(Program::OpCode op) {
+        using OpCode = Program::OpCode;
+        Operand right = popOperand();
+        Operand left = popOperand();
+        if (isLiteral(right.start, code.size()) && isLiteral(left.start, right.start)) {
+            CValue lval = literal(left.start), rval = literal(right.start);
+            CValue value = op == OpCode::Add ? Program::add(lval, rval)
+                           : op >= OpCode::Eq ? Program::compare(op, lval, rval) : Program::arithmetic(op, lval, rval);
+            const double* number = std::get_if<double>(&value);
+            if ((number && std::isfinite(*number)) || std::holds_alternative<std::string>(value)) {
+                dropLiteral();
+                dropLiteral();
+                if (number)
+                    valNumber(*number);
+                else
+                    valString(std::string_view(std::get<std::string>(value)));
+                return;
+            }
+        }
+        if (left.numeric && (((op == OpCode::Mul || op == OpCode::Div || op == OpCode::Pow) && isNumber(right.start, code.size(), 1))
+                             || (op == OpCode::Sub && isNumber(right.start, code.size(), 0)))) {
+            dropLiteral();
+            operands.push_back(left);
+            return;
+        }
+        if (right.numeric && op == OpCode::Mul && isNumber(left.start, right.start, 1)) {
+            uint32_t index = code[left.start].arg;
+            code.erase(code.begin() + left.start);
+            numbers.erase(numbers.begin() + index);
+            for (size_t pc = left.start; pc < code.size(); pc++) {
+                if (code[pc].op == OpCode::Number && code[pc].arg > index)
+                    code[pc].arg--;
+            }
+            operands.push_back({left.start, -1, true, right.negatesNumber});
+            return;
+        }
+        operands.push_back({left.start, -1, op != OpCode::Add});
+        emit(op, 0);
+    }
+
+    void function(Program::OpCode op) {
+        int range = popRange();
+        operands.push_back({code.size(), -1, true});
+        emit(op, range);
+    }
+
+    //The instructions start..end are a single Number or String literal
+    bool isLiteral(size_t start, size_t end) const {
+        return end == start + 1 && (code[start].op == Program::OpCode::Number || code[start].op == Program::OpCode::String);
+    }
+
+    bool isNumber(size_t start, size_t end, double number) const {
+        return isLiteral(start, end) && code[start].op == Program::OpCode::Number && numbers[code[start].arg] == number;
+    }
+
+    CValue literal(size_t pc) const {
+        const Program::Instruction& ins = code[pc];
+        if (ins.op == Program::OpCode::Number)
+            return numbers[ins.arg];
+        return std::string(characters, slices[ins.arg].offset, slices[ins.arg].length);
+    }
+
+    //Removes the last instruction, a literal, with its entry at the end of the pool
+    void dropLiteral() {
+        Program::Instruction ins = code.back();
+        code.pop_back();
+        if (ins.op == Program::OpCode::Number) {
+            numbers.resize(ins.arg);
+        } else {
+            characters.resize(slices[ins.arg].offset);
+            slices.resize(ins.arg);
+        }
+    }
+
+    Operand popOperand() {
+        if (operands.empty() || operands.back().range >= 0)
+            throw std::invalid_argument("Expected a value.");
+        Operand operand = operands.back();
+        operands.pop_back();
+        return operand;
+    }
+
+    int popRange() {
+        if (operands.empty() || operands.back().range < 0)
+            throw std::invalid_argument("Function expects a range.");
+        int range = operands.back().range;
+        operands.pop_back();
+        return range;
+    }
+};
+
+// Definition of various Cell Class methods
+void Cell::setProgram(std::shared_ptr<const Program> compiled, const std::pair<int, int>& position) {
+    reset();
+    formula = new Formula{std::move(compiled), position, std::monostate()};
+    kind = Kind::Formula;
+}
+
+CValue Cell::evaluate(const CellGrid& context) const {
+    switch (kind) {
+        case Kind::Number:
+            return number;
+        case Kind::Text:
+            return *text;
+        case Kind::Formula:
+            if (formula->cyclic)
+                return std::monostate();
+            if (formula->dirty) {
+                formula->cachedValue = formula->program->run(context, formula->anchor);
+                formula->dirty = false;
+            }
+            return formula->cachedValue;
+        default:
+            return std::monostate();
+    }
+}
+
+const std::shared_ptr<const Program>& Cell::getProgram() const {
+    static const std::shared_ptr<const Program> none;
+    return kind == Kind::Formula ? formula->program : none;
+}
+
+// Definition of Program methods
+CValue Program::run(const CellGrid& context, const std::pair<int, int>& anchor) const {
+    //The stack is shared by the nested evaluations of the referenced cells, each of them uses the values above base
+    thread_local std::vector<CValue> stack;
+    size_t base = stack.size();
+
+    std::span<const Instruction> code = this->code();
+    for (size_t pc = 0; pc < code.size();) {
+        const Instruction& ins = code[pc];
+        switch (ins.op) {
+            case OpCode::Number:
+                stack.emplace_back(numbers()[ins.arg]);
+                break;
+            case OpCode::String:
+                stack.emplace_back(std::string(string(ins.arg)));
+                break;
+            case OpCode::Reference: {
+                const Cell* cell = context.find(references()[ins.arg].resolve(anchor));
+                CValue value = cell ? cell->evaluate(context) : CValue();
+                stack.push_back(std::move(value));
+                break;
+            }
+            case OpCode::Add: {
+                CValue right = std::move(stack.back());
+                stack.pop_back();
+                stack.back() = add(stack.back(), right);
+                break;
+            }
+            case OpCode::Sub:
+            case OpCode::Mul:
+            case OpCode::Div:
+            case OpCode::Pow: {
+                CValue right = std::move(stack.back());
+                stack.pop_back();
+                stack.back() = arithmetic(ins.op, stack.back(), right);
+                break;
+            }
+            case OpCode::Neg:
+                if (std::holds_alternative<double>(stack.back())) {
+                    stack.back() = -std::get<double>(stack.back());
+                } else {
+                    stack.back() = std::monostate();
+                }
+                break;
+            case OpCode::Eq:
+            case OpCode::Ne:
+            case OpCode::Lt:
+            case OpCode::Le:
+            case OpCode::Gt:
+            case OpCode::Ge: {
+                CValue right = std::move(stack.back());
+                stack.pop_back();
+                stack.back() = compare(ins.op, stack.back(), right);
+                break;
+            }
+            case OpCode::Sum:
+            case OpCode::Count: {
+                RangeSummary summary;
+                context.summarize(ranges()[ins.arg].cells(anchor), summary, false);
+                if (ins.op == OpCode::Count) {
+                    stack.emplace_back(static_cast<double>(summary.values));
+                } else if (summary.numbers) {
+                    stack.emplace_back(summary.sum);
+                } else {
+                    stack.emplace_back();
+                }
+                break;
+            }
+            case OpCode::Min:
+            case OpCode::Max: {
+                RangeSummary summary;
+                context.summarize(ranges()[ins.arg].cells(anchor), summary);
+                if (!summary.numbers) {
+                    stack.emplace_back();
+                } else {
+                    stack.emplace_back(ins.op == OpCode::Min ? summary.min : summary.max);
+                }
+                break;
+            }
+            case OpCode::CountVal: {
+                //Counting evaluates the cells of the range, which may grow the stack, so the value is moved out first
+                CValue value = std::move(stack.back());
+                stack.back() = context.countValue(ranges()[ins.arg].cells(anchor), value);
+                break;
+            }
+            case OpCode::Test: {
+                CValue condition = std::move(stack.back());
+                stack.pop_back();
+                if (!std::holds_alternative<double>(condition)) {
+                    //The result of if() is undefined, skip both branches through the Jump ending the true branch
+                    stack.emplace_back();
+                    pc += ins.arg - 1;
+                    continue;
+                }
+                if (std::get<double>(condition) == 0) {
+                    pc += ins.arg;
+                    continue;
+                }
+                break;
+            }
+            case OpCode::Jump:
+                pc += ins.arg;
+                continue;
+        }
+        pc++;
+    }
+
+    CValue result = std::move(stack.back());
+    stack.resize(base);
+    return result;
+}
+
+void Program::write(std::string& out, const std::pair<int, int>& anchor) const {
+    //Operator precedence, a higher number binds tighter
+    enum Precedence { Equality = 1, Relational, Additive, Multiplicative, Unary, Power, Primary };
+    //The operands are written one after another into out, an operator then inserts its symbol and the parentheses it
+    //needs between and around them, so no text is built apart
+    struct Operand {
+        size_t start;
+        int precedence;
+    };
+
+    std::span<const Instruction> code = this->code();
+    thread_local std::vector<Operand> operands;
+    thread_local std::vector<size_t> joins;
+    operands.clear();
+    joins.clear();
+
+    auto writeRange = [&out, &anchor](const Range& range) {
+        range.from.write(out, anchor);
+        out += ':';
+        range.to.write(out, anchor);
+        out += ')';
+    };
+
+    for (size_t pc = 0; pc <= code.size(); pc++) {
+        //Close the if() calls whose branches end here, the innermost one first
+        while (!joins.empty() && joins.back() == pc) {
+            joins.pop_back();
+            size_t ifFalse = operands.back().start;
+            operands.pop_back();
+            size_t ifTrue = operands.back().start;
+            operands.pop_back();
+            Operand& condition = operands.back();
+            out += ')';
+            out.insert(ifFalse, 1, ',');
+            out.insert(ifTrue, 1, ',');
+            out.insert(condition.start, "if(");
+            condition.precedence = Primary;
+        }
+        if (pc == code.size())
+            break;
+
+        const Instruction& ins = code[pc];
+        switch (ins.op) {
+            case OpCode::Number: {
+                double number = numbers()[ins.arg];
+                //A negative literal, -0 included, is written with its sign and binds like a unary minus
+                operands.push_back({out.size(), std::signbit(number) ? Unary : Primary});
+                //to_chars writes inf, which is not a number to the parser, but a literal too large for a double is
+                if (std::isinf(number)) {
+                    out += number < 0 ? "-1e999" : "1e999";
+                    break;
+                }
+                char buffer[32];
+                auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), number);
+                out.append(buffer, end);
+                break;
+            }
+            case OpCode::String:
+                operands.push_back({out.size(), Primary});
+                out += '"';
+                for (char ch : string(ins.arg)) {
+                    out += ch;
+                    if (ch == '"')
+                        out += '"';
+                }
+                out += '"';
+                break;
+            case OpCode::Reference:
+                operands.push_back({out.size(), Primary});
+                references()[ins.arg].write(out, anchor);
+                break;
+            case OpCode::Neg: {
+                Operand& operand = operands.back();
+                if (operand.precedence < Unary) {
+                    out.insert(operand.start, 1, '(');
+                    out += ')';
+                }
+                out.insert(operand.start, 1, '-');
+                operand.precedence = Unary;
+                break;
+            }
+            case OpCode::Sum:
+            case OpCode::Min:
+            case OpCode::Max:
+            case OpCode::Count: {
+                static const char* const names[] = {"sum(", "min(", "max(", "count("};
+                operands.push_back({out.size(), Primary});
+                out += names[static_cast<int>(ins.op) - static_cast<int>(OpCode::Sum)];
+                writeRange(ranges()[ins.arg]);
+                break;
+            }
+            case OpCode::CountVal: {
+                Operand& value = operands.back();
+                out.insert(value.start, "countval(");
+                out += ',';
+                writeRange(ranges()[ins.arg]);
+                value.precedence = Primary;
+                break;
+            }
+            case OpCode::Test:
+                break;
+            case OpCode::Jump:
+                joins.push_back(pc + ins.arg);
+                break;
+            default: {
+                static const std::map<OpCode, std::pair<const char*, int>> binaryOps = {
+                        {OpCode::Add, {"+", Additive}}, {OpCode::Sub, {"-", Additive}},
+                        {OpCode::Mul, {"*", Multiplicative}}, {OpCode::Div, {"/", Multiplicative}},
+                        {OpCode::Pow, {"^", Power}},
+                        {OpCode::Eq, {"=", Equality}}, {OpCode::Ne, {"<>", Equality}},
+                        {OpCode::Lt, {"<", Relational}}, {OpCode::Le, {"<=", Relational}},
+                        {OpCode::Gt, {">", Relational}}, {OpCode::Ge, {">=", Relational}}};
+                const auto& [symbol, precedence] = binaryOps.at(ins.op);
+                Operand right = operands.back();
+                operands.pop_back();
+                Operand& left = operands.back();
+                //All operators are left associative, so only a right operand of the same precedence needs parentheses
+                if (right.precedence <= precedence) {
+                    out.insert(right.start, 1, '(');
+                    out += ')';
+                }
+                out.insert(right.start, symbol);
+                if (left.precedence < precedence) {
+                    out.insert(right.start, 1, ')');
+                    out.insert(left.start, 1, '(');
+                }
+                left.precedence = precedence;
+                break;
+            }
+        }
+    }
+}
+
+
+std::shared_ptr<Program> Program::deserialize(std::span<const std::byte> bytes) {
+    if (bytes.size() < sizeof(Layout))
+        return nullptr;
+    std::shared_ptr<Program> program(new Program());
+    std::memcpy(&program->layout, bytes.data(), sizeof(Layout));
+    if (bytes.size() - sizeof(Layout) < program->layout.size)
+        return nullptr;
+    program->storage.reset(new std::byte[program->layout.size]);
+    if (program->layout.size)
+        std::memcpy(program->storage.get(), bytes.data() + sizeof(Layout), program->layout.size);
+    return program->valid() ? program : nullptr;
+}
+
+bool Program::valid() const {
+    auto fits = [this](uint32_t offset, uint32_t count, size_t itemSize, size_t alignment) {
+        return offset % alignment == 0 && offset <= layout.size && count <= (layout.size - offset) / itemSize;
+    };
+    if (!fits(layout.numbers, layout.numberCount, sizeof(double), alignof(double)) ||
+        !fits(layout.code, layout.codeSize, sizeof(Instruction), alignof(Instruction)) ||
+        !fits(layout.references, layout.referenceCount, sizeof(Reference), alignof(Reference)) ||
+        !fits(layout.ranges, layout.rangeCount, sizeof(Range), alignof(Range)) ||
+        !fits(layout.slices, layout.sliceCount, sizeof(Slice), alignof(Slice)) || layout.chars > layout.size)
+        return false;
+    for (const Slice& slice : pool<const Slice>(layout.slices, layout.sliceCount)) {
+        if (slice.offset < layout.chars || slice.offset > layout.size || slice.length > layout.size - slice.offset)
+            return false;
+    }
+
+    //Stack depth before each instruction, the branches of if() must meet with the same depth
+    auto program = code();
+    std::vector<int> depths(program.size() + 1, -1);
+    auto merge = [&depths](size_t target, int depth) {
+        if (depths[target] >= 0 && depths[target] != depth)
+            return false;
+        depths[target] = depth;
+        return true;
+    };
+    int depth = 0;
+    bool reachable = true;
+    for (size_t pc = 0; pc <= program.size(); pc++) {
+        if (depths[pc] >= 0) {
+            if (reachable && depth != depths[pc])
+                return false;
+            depth = depths[pc];
+            reachable = true;
+        }
+        if (!reachable)
+            return false;
+        if (pc == program.size())
+            break;
+
+        const Instruction& ins = program[pc];
+        auto indexes = [&ins](uint32_t count) { return ins.arg < count; };
+        switch (ins.op) {
+            case OpCode::Number:
+                if (!indexes(layout.numberCount))
+                    return false;
+                depth++;
+                break;
+            case OpCode::String:
+                if (!indexes(layout.sliceCount))
+                    return false;
+                depth++;
+                break;
+            case OpCode::Reference:
+                if (!indexes(layout.referenceCount))
+                    return false;
+                depth++;
+                break;
+            case OpCode::Sum:
+            case OpCode::Min:
+            case OpCode::Max:
+            case OpCode::Count:
+                if (!indexes(layout.rangeCount))
+                    return false;
+                depth++;
+                break;
+            case OpCode::CountVal:
+                if (!indexes(layout.rangeCount) || depth < 1)
+                    return false;
+                break;
+            case OpCode::Neg:
+                if (depth < 1)
+                    return false;
+                break;
+            case OpCode::Add:
+            case OpCode::Sub:
+            case OpCode::Mul:
+            case OpCode::Div:
+            case OpCode::Pow:
+            case OpCode::Eq:
+            case OpCode::Ne:
+            case OpCode::Lt:
+            case OpCode::Le:
+            case OpCode::Gt:
+            case OpCode::Ge:
+                if (depth < 2)
+                    return false;
+                depth--;
+                break;
+            case OpCode::Test:
+                //An undefined condition lands on the Jump before the false branch with the undefined result pushed
+                if (depth < 1 || ins.arg < 2 || ins.arg > program.size() - pc || program[pc + ins.arg - 1].op != OpCode::Jump ||
+                    !merge(pc + ins.arg, depth - 1) || !merge(pc + ins.arg - 1, depth))
+                    return false;
+                depth--;
+                break;
+            case OpCode::Jump:
+                if (ins.arg < 1 || ins.arg > program.size() - pc || !merge(pc + ins.arg, depth))
+                    return false;
+                reachable = false;
+                break;
+            default:
+                return false;
+        }
+    }
+    return depth == 1;
+}
+
+
+//Recursive descent parser of the cell expressions. It drives a CTokenBuilder with the same postfix calls as
+//parseExpression and follows the precedence of the README, from the loosest: = <>, < <= > >=, + -, * /, unary -, ^
+//(all binary operators left associative). The text is read in place and the tokens are passed as views into it.
+class ExpressionParser {
+public:
+    //Parses expr, which starts with '=', throws std::invalid_argument when it is not a valid expression
+    static void parse(std::string_view expr, CTokenBuilder& builder) {
+        ExpressionParser parser(expr, builder);
+        if (!parser.accept('='))
+            parser.fail("Expression must start with =");
+        parser.parseEquality();
+        parser.skipSpaces();
+        if (parser.pos != expr.size())
+            parser.fail("Unexpected character");
+    }
+
+private:
+    //Parentheses and unary minus recurse, the limit keeps hostile input from exhausting the stack
+    static constexpr int MAX_DEPTH = 1000;
+
+    std::string_view text;
+    CTokenBuilder& builder;
+    size_t pos = 0;
+    int depth = 0;
+
+    ExpressionParser(std::string_view text, CTokenBuilder& builder) : text(text), builder(builder) {}
+
+    [[noreturn]] void fail(const std::string& message) const {
+        throw std::invalid_argument(message + " at position " + std::to_string(pos) + " of " + std::string(text));
+    }
+
+    void skipSpaces() {
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+            pos++;
+    }
+
+    bool accept(char ch) {
+        skipSpaces();
+        if (pos < text.size() && text[pos] == ch) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool accept(std::string_view token) {
+        skipSpaces();
+        if (text.substr(pos, token.size()) == token) {
+            pos += token.size();
+            return true;
+        }
+        return false;
+    }
+
+    void enter() {
+        if (++depth > MAX_DEPTH)
+            fail("Expression nested too deeply");
+    }
+
+    void parseEquality() {
+        parseRelational();
+        while (true) {
+            if (accept("<>")) {
+                parseRelational();
+                builder.opNe();
+            } else if (accept('=')) {
+                parseRelational();
+                builder.opEq();
+            } else {
+                return;
+            }
+        }
+    }
+
+    void parseRelational() {
+        parseAdditive();
+        while (true) {
+            skipSpaces();
+            if (text.substr(pos, 2) == "<>") {
+                return;
+            } else if (accept("<=")) {
+                parseAdditive();
+                builder.opLe();
+            } else if (accept(">=")) {
+                parseAdditive();
+                builder.opGe();
+            } else if (accept('<')) {
+                parseAdditive();
+                builder.opLt();
+            } else if (accept('>')) {
+                parseAdditive();
+                builder.opGt();
+            } else {
+                return;
+            }
+        }
+    }
+
+    void parseAdditive() {
+        parseMultiplicative();
+        while (true) {
+            if (accept('+')) {
+                parseMultiplicative();
+                builder.opAdd();
+            } else if (accept('-')) {
+                parseMultiplicative();
+                builder.opSub();
+            } else {
+                return;
+            }
+        }
+    }
+
+    void parseMultiplicative() {
+        parseUnary();
+        while (true) {
+            if (accept('*')) {
+                parseUnary();
+                builder.opMul();
+            } else if (accept('/')) {
+                parseUnary();
+                builder.opDiv();
+            } else {
+                return;
+            }
+        }
+    }
+
+    void parseUnary() {
+        if (!accept('-')) {
+            parsePower();
+            return;
+        }
+        enter();
+        parseUnary();
+        depth--;
+        builder.opNeg();
+    }
+
+    void parsePower() {
+        parsePrimary();
+        while (accept('^')) {
+            parseExponent();
+            builder.opPow();
+        }
+    }
+
+    //The exponent binds tighter than unary minus, so a negative exponent such as 2^-1 is accepted on its own
+    void parseExponent() {
+        if (!accept('-')) {
+            parsePrimary();
+            return;
+        }
+        enter();
+        parseExponent();
+        depth--;
+        builder.opNeg();
+    }
+
+    void parsePrimary() {
+        skipSpaces();
+        if (pos >= text.size())
+            fail("Unexpected end of expression");
+        char ch = text[pos];
+        if (ch == '(') {
+            pos++;
+            enter();
+            parseEquality();
+            depth--;
+            if (!accept(')'))
+                fail("Missing )");
+        } else if (ch == '"') {
+            parseString();
+        } else if (std::isdigit(static_cast<unsigned char>(ch)) || ch == '.') {
+            parseNumber();
+        } else if (ch == '$' || std::isalpha(static_cast<unsigned char>(ch))) {
+            parseName();
+        } else {
+            fail("Unexpected character");
+        }
+    }
+
+    //A string literal, a double quote inside is written twice. A literal without doubled quotes is passed as a view of
+    //the text, the others are collapsed into a buffer reused by the parses of the thread.
+    void parseString() {
+        size_t start = ++pos;
+        size_t quote = text.find('"', pos);
+        if (quote == std::string_view::npos)
+            fail("Unterminated string");
+        if (quote + 1 >= text.size() || text[quote + 1] != '"') {
+            pos = quote + 1;
+            builder.valString(text.substr(start, quote - start));
+            return;
+        }
+
+        thread_local std::string value;
+        value.clear();
+        while (true) {
+            quote = text.find('"', pos);
+            if (quote == std::string_view::npos)
+                fail("Unterminated string");
+            value.append(text.substr(pos, quote - pos));
+            pos = quote + 1;
+            if (pos >= text.size() || text[pos] != '"')
+                break;
+            value += '"';
+            pos++;
+        }
+        builder.valString(std::string_view(value));
+    }
+
+    void parseNumber() {
+        size_t start = pos;
+        auto skipDigits = [this]() {
+            size_t first = pos;
+            while (pos < text.size() && std::isdigit(static_cast<unsigned char>(text[pos])))
+                pos++;
+            return pos > first;
+        };
+        bool digits = skipDigits();
+        if (pos < text.size() && text[pos] == '.') {
+            pos++;
+            digits = skipDigits() || digits;
+        }
+        if (!digits)
+            fail("Invalid number");
+        if (pos < text.size() && (text[pos] == 'e' || text[pos] == 'E')) {
+            pos++;
+            if (pos < text.size() && (text[pos] == '+' || text[pos] == '-'))
+                pos++;
+            if (!skipDigits())
+                fail("Invalid exponent");
+        }
+
+        double value = 0;
+        auto [end, ec] = std::from_chars(text.data() + start, text.data() + pos, value);
+        if (ec == std::errc::result_out_of_range) {
+            //Too large or too small for a double, round to infinity or zero like strtod
+            value = std::strtod(std::string(text.substr(start, pos - start)).c_str(), nullptr);
+        } else if (ec != std::errc() || end != text.data() + pos) {
+            fail("Invalid number");
+        }
+        builder.valNumber(value);
+    }
+
+    //A cell reference, a range, or a function call
+    void parseName() {
+        size_t start = pos;
+        CellReference from;
+        if (decodeReference(text, pos, from)) {
+            if (pos < text.size() && text[pos] == ':') {
+                pos++;
+                CellReference to;
+                if (!decodeReference(text, pos, to))
+                    fail("Invalid range");
+                builder.valRange(from, to);
+            } else {
+                builder.valReference(from);
+            }
+            return;
+        }
+
+        while (pos < text.size() && std::isalpha(static_cast<unsigned char>(text[pos])))
+            pos++;
+        std::string_view name = text.substr(start, pos - start);
+        if (name.empty() || !accept('('))
+            fail("Invalid reference");
+        auto [function, expected] = lookup(name);
+        int count = 0;
+        if (!accept(')')) {
+            enter();
+            do {
+                parseEquality();
+                count++;
+            } while (accept(','));
+            depth--;
+            if (!accept(')'))
+                fail("Missing )");
+        }
+        if (count != expected)
+            fail("Wrong number of arguments of " + std::string(name));
+        builder.funcCall(function, count);
+    }
+
+    //Lower case name and number of parameters of a function, the types of the arguments are checked by the builder
+    std::pair<std::string_view, int> lookup(std::string_view name) const {
+        static constexpr std::pair<std::string_view, int> functions[] = {
+                {"sum", 1}, {"min", 1}, {"max", 1}, {"count", 1}, {"countval", 2}, {"if", 3}};
+        for (const auto& function : functions) {
+            if (std::equal(name.begin(), name.end(), function.first.begin(), function.first.end(),
+                           [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; }))
+                return function;
+        }
+        fail("Unknown function " + std::string(name));
+    }
+};
+
+
+//Reverse dependency index: for a key, the formula cells to revisit when the cells behind the key change. Like the
+//cell grid, copies share the entries, which are grouped into shards of 64 consecutive keys: copying is O(1) and the
+//first write after a copy clones the shard table and then only the shards written to.
+class DependentIndex {
+public:
+    using CellSet = std::set<std::pair<int, int>>;
+
+    DependentIndex() = default;
+
+    //As with CellGrid, moving an index copies the pointer to the shared entries
+    DependentIndex(const DependentIndex& other) = default;
+
+    DependentIndex& operator=(const DependentIndex& other) = default;
+
+    const CellSet* find(uint64_t key) const {
+        auto shard = table->find(key >> SHARD_BITS);
+        if (shard == table->end())
+            return nullptr;
+        auto it = shard->second->find(key);
+        return it == shard->second->end() ? nullptr : &it->second;
+    }
+
+    void insert(uint64_t key, const std::pair<int, int>& cellId) {
+        mutableShard(key)[key].insert(cellId);
+    }
+
+    void erase(uint64_t key, const std::pair<int, int>& cellId) {
+        if (!find(key))
+            return;
+        Shard& shard = mutableShard(key);
+        auto it = shard.find(key);
+        it->second.erase(cellId);
+        if (it->second.empty())
+            shard.erase(it);
+    }
+
+    void clear() {
+        table = std::make_shared<Table>();
+    }
+
+private:
+    static constexpr int SHARD_BITS = 6;
+
+    using Shard = std::unordered_map<uint64_t, CellSet>;
+    using Table = std::unordered_map<uint64_t, std::shared_ptr<Shard>>;
+
+    std::shared_ptr<Table> table = std::make_shared<Table>();
+
+    Shard& mutableShard(uint64_t key) {
+        if (table.use_count() > 1)
+            table = std::make_shared<Table>(*table);
+        auto& shard = (*table)[key >> SHARD_BITS];
+        if (!shard)
+            shard = std::make_shared<Shard>();
+        else if (shard.use_count() > 1)
+            shard = std::make_shared<Shard>(*shard);
+        return *shard;
+    }
+};
+
+
+//Table of the distinct programs of a sheet. Formulas are compiled relative to their cell, so a formula filled down or
+//across compiles to the same program everywhere and all these cells share a single copy of it. Only weak pointers are
+//kept, a program is freed with the last cell using it. The table is a cache without effect on the values, so copies
+//of a sheet share it and it is locked on its own.
+class ProgramPool {
+public:
+    std::shared_ptr<const Program> intern(std::shared_ptr<const Program> program) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t hash = program->hash();
+        auto [first, last] = programs.equal_range(hash);
+        for (auto it = first; it != last;) {
+            auto existing = it->second.lock();
+            if (!existing) {
+                it = programs.erase(it);
+            } else if (*existing == *program) {
+                return existing;
+            } else {
+                ++it;
+            }
+        }
+        programs.emplace(hash, program);
+        if (programs.size() >= sweepSize)
+            sweep();
+        return program;
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_multimap<size_t, std::weak_ptr<const Program>> programs;
+    size_t sweepSize = 1024;
+
+    //Drops the entries of freed programs, the next sweep happens when the table has doubled again
+    void sweep() {
+        std::erase_if(programs, [](const auto& entry) { return entry.second.expired(); });
+        sweepSize = std::max<size_t>(1024, programs.size() * 2);
+    }
+};
+
+
+//CRC-32 (IEEE 802.3) of size bytes, crc is the checksum of the preceding data when it is computed piecewise
+uint32_t crc32(const void* data, size_t size, uint32_t crc = 0) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> values{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) {
+                value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+            }
+            values[i] = value;
+        }
+        return values;
+    }();
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+//Fixed set of worker threads running submitted tasks in the order they were submitted, shared by all sheets.
+//parallelFor splits a loop between the workers and the calling thread, which steal iterations from each other.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads) {
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    //Runs fn on a worker, the future reports its completion and rethrows its exception
+    template <typename Fn>
+    std::future<void> submit(Fn&& fn) {
+        auto task = std::make_shared<std::packaged_task<void()>>(std::forward<Fn>(fn));
+        std::future<void> done = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace_back([task]() { (*task)(); });
+        }
+        wakeup.notify_one();
+        return done;
+    }
+
+    unsigned size() const {
+        return static_cast<unsigned>(workers.size());
+    }
+
+    //Calls fn(i) for every i in [0, count) and returns when all calls have finished. Every participant owns a slice
+    //of the indexes and takes grains from its front, then steals grains from the other slices, so uneven iterations
+    //are balanced. The caller participates and can finish the loop alone, so nested loops cannot deadlock.
+    template <typename Fn>
+    void parallelFor(size_t count, Fn&& fn) {
+        size_t participants = std::min<size_t>(workers.size() + 1, (count + MIN_GRAIN - 1) / MIN_GRAIN);
+        if (participants <= 1) {
+            for (size_t i = 0; i < count; i++) {
+                fn(i);
+            }
+            return;
+        }
+
+        struct Slice {
+            std::atomic<size_t> next;
+            size_t end;
+        };
+        struct Loop {
+            std::vector<Slice> slices;
+            size_t grain;
+            std::atomic<size_t> finished{0};
+            std::mutex mutex;
+            std::exception_ptr error;
+
+            explicit Loop(size_t participants) : slices(participants) {}
+        };
+        auto loop = std::make_shared<Loop>(participants);
+        loop->grain = std::max<size_t>(1, count / (participants * 8));
+        for (size_t i = 0; i < participants; i++) {
+            loop->slices[i].next = count * i / participants;
+            loop->slices[i].end = count * (i + 1) / participants;
+        }
+
+        //The workers may start after the loop has finished, so they hold the loop but must not touch fn then
+        auto participate = [count](Loop& loop, size_t first, Fn& fn) {
+            for (size_t k = 0; k < loop.slices.size(); k++) {
+                Slice& slice = loop.slices[(first + k) % loop.slices.size()];
+                while (true) {
+                    size_t begin = slice.next.fetch_add(loop.grain);
+                    if (begin >= slice.end)
+                        break;
+                    size_t end = std::min(begin + loop.grain, slice.end);
+                    try {
+                        for (size_t i = begin; i < end; i++) {
+                            fn(i);
+                        }
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(loop.mutex);
+                        if (!loop.error)
+                            loop.error = std::current_exception();
+                    }
+                    if (loop.finished.fetch_add(end - begin) + (end - begin) == count)
+                        loop.finished.notify_all();
+                }
+            }
+        };
+        for (size_t i = 1; i < participants; i++) {
+            submit([loop, i, participate, &fn]() { participate(*loop, i, fn); });
+        }
+        participate(*loop, 0, fn);
+        for (size_t done = loop->finished.load(); done < count; done = loop->finished.load()) {
+            loop->finished.wait(done);
+        }
+        if (loop->error)
+            std::rethrow_exception(loop->error);
+    }
+
+    //The pool of the process, one worker per hardware thread
+    static ThreadPool& shared() {
+        static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+        return pool;
+    }
+
+private:
+    //Loops shorter than two grains run on the calling thread
+    static constexpr size_t MIN_GRAIN = 16;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeup.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+
+//Reads a stream line by line through a large buffer, the lines are views into the buffer
+class LineReader {
+public:
+    explicit LineReader(std::istream& is) : is(is) {}
+
+    //Returns the next line without its newline, the view is valid until the next call. Returns false at the end, a
+    //last line without a newline is incomplete and is not returned.
+    bool next(std::string_view& line) {
+        while (true) {
+            size_t newline = buffer.find('\n', pos);
+            if (newline != std::string::npos) {
+                line = std::string_view(buffer).substr(pos, newline - pos);
+                pos = newline + 1;
+                return true;
+            }
+            //Keep the incomplete line and read the next chunk after it
+            buffer.erase(0, pos);
+            pos = 0;
+            size_t kept = buffer.size();
+            buffer.resize(kept + CHUNK);
+            is.read(buffer.data() + kept, CHUNK);
+            buffer.resize(kept + static_cast<size_t>(is.gcount()));
+            if (buffer.size() == kept)
+                return false;
+        }
+    }
+
+private:
+    static constexpr size_t CHUNK = 1 << 16;
+
+    std::istream& is;
+    std::string buffer;
+    size_t pos = 0;
+};
+
+
+// Class representing a Spreadsheet
+class CSpreadsheet {
+public:
+    static unsigned capabilities() {
+              return SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FUNCTIONS | SPREADSHEET_FILE_IO | SPREADSHEET_PARSER;
+    }
+
+    CSpreadsheet() = default;
+
+    //Copies share all data until written, so a copy is O(1). Moving is copying, it leaves the source a valid sheet.
+    CSpreadsheet(const CSpreadsheet& other) = default;
+
+    CSpreadsheet& operator=(const CSpreadsheet& other) = default;
+
+    bool setCell(const CPos &pos, const std::string &contents) {
+        std::pair<int, int> key = {pos.getRow(), pos.getCol()};
+        if (!storeCell(key, contents))
+            return false;
+        invalidate({key});
+        return true;
+    }
+
+    //A setCell of a batch
+    struct Edit {
+        CPos pos;
+        std::string contents;
+    };
+
+    //Applies the edits as if by setCell in their order, or none of them if any contents are invalid. All contents are
+    //parsed on the thread pool before the sheet is touched, and the cells depending on the edits are invalidated in
+    //one pass at the end.
+    bool applyEdits(std::span<const Edit> edits) {
+        std::vector<Cell> compiled(edits.size());
+        std::vector<char> valid(edits.size());
+        ThreadPool::shared().parallelFor(edits.size(), [&](size_t i) {
+            valid[i] = compileCell({edits[i].pos.getRow(), edits[i].pos.getCol()}, edits[i].contents, compiled[i]);
+        });
+        if (std::find(valid.begin(), valid.end(), false) != valid.end())
+            return false;
+
+        std::vector<std::pair<int, int>> keys;
+        keys.reserve(edits.size());
+        for (size_t i = 0; i < edits.size(); i++) {
+            keys.emplace_back(edits[i].pos.getRow(), edits[i].pos.getCol());
+            placeCell(keys.back(), std::move(compiled[i]));
+        }
+        invalidate(keys);
+        return true;
+    }
+
+
+    CValue getValue(CPos pos) const {
+        std::pair<int, int> key = {pos.getRow(), pos.getCol()};
+
+        const Cell* cell = std::as_const(cells).find(key);
+        if (!cell) {
+            return std::monostate();
+        }
+
+        return cell->evaluate(cells);
+    }
+
+
+    //Copies the cells in place without staging them. Like memmove, the rows and the columns are walked away from the
+    //direction of the shift, so every source cell is read before the copy can overwrite it.
+    void copyRect(CPos dst, CPos src, int w = 1, int h = 1) {
+        int rowShift = dst.getRow() - src.getRow();
+        int colShift = dst.getCol() - src.getCol();
+        std::vector<std::pair<int, int>> changed;
+        changed.reserve(static_cast<size_t>(std::max(w, 0)) * std::max(h, 0));
+
+        for (int i = 0; i < h; ++i) {
+            int r = rowShift > 0 ? h - 1 - i : i;
+            for (int j = 0; j < w; ++j) {
+                int c = colShift > 0 ? w - 1 - j : j;
+                std::pair<int, int> srcPos = {src.getRow() + r, src.getCol() + c};
+                std::pair<int, int> dstPos = {dst.getRow() + r, dst.getCol() + c};
+
+                Cell copy;
+                if (const Cell* srcCell = std::as_const(cells).find(srcPos)) {
+                    copy = *srcCell;
+                    //The program is relative to its cell, so the copy shares it and only moves the anchor
+                    if (copy.getProgram())
+                        copy.setProgram(copy.getProgram(), dstPos);
+                }
+                unlinkCell(dstPos);
+                cells.assign(dstPos, std::move(copy));
+                linkCell(dstPos);
+                changed.push_back(dstPos);
+            }
+        }
+        invalidate(changed);
+    }
+
+
+    //Reads comma separated values into the cells right and below origin, one line per row. A field that parses as a
+    //number completely becomes a number, a quoted field (with "" for a quote) is always a string and other fields are
+    //strings too, an empty field leaves its cell alone. The input is read in fixed size chunks and the fields are
+    //parsed in place, only a field split between chunks or holding quotes is copied. Returns false and leaves the
+    //sheet unchanged if a quoted field is not closed properly.
+    bool loadCsv(std::istream& is, CPos origin) {
+        //The rows go into a copy, which shares all blocks but the ones written, and replace the sheet at the end
+        CSpreadsheet staged = *this;
+        std::vector<std::pair<int, int>> keys;
+        std::unique_ptr<char[]> buffer(new char[CSV_CHUNK]);
+        std::string field;
+        enum class State { FieldStart, Unquoted, Quoted, QuoteInQuoted } state = State::FieldStart;
+        bool afterCR = false;
+        int row = origin.getRow(), col = origin.getCol();
+
+        auto store = [&](std::string_view text, bool quoted) {
+            std::pair<int, int> key = {row, col++};
+            Cell cell;
+            double number = 0;
+            if (quoted) {
+                cell.setValue(staged.cells.intern(text));
+            } else if (text.empty()) {
+                return;
+            } else if (parseLiteral(text, number)) {
+                cell.setValue(number);
+            } else {
+                cell.setValue(staged.cells.intern(text));
+            }
+            staged.placeCell(key, std::move(cell));
+            keys.push_back(key);
+        };
+        //Ends the current field at the separator ch
+        auto separate = [&](std::string_view text, bool quoted, char ch) {
+            store(text, quoted);
+            field.clear();
+            state = State::FieldStart;
+            if (ch == ',')
+                return;
+            afterCR = ch == '\r';
+            row++;
+            col = origin.getCol();
+            //The dependents are invalidated in batches, so the keys to invalidate never take much memory
+            if (keys.size() >= CSV_BATCH) {
+                staged.invalidate(keys);
+                keys.clear();
+            }
+        };
+        auto isSeparator = [](char ch) { return ch == ',' || ch == '\n' || ch == '\r'; };
+
+        while (is) {
+            is.read(buffer.get(), CSV_CHUNK);
+            const char* p = buffer.get();
+            const char* end = p + is.gcount();
+            while (p < end) {
+                if (afterCR) {
+                    afterCR = false;
+                    if (*p == '\n') {
+                        p++;
+                        continue;
+                    }
+                }
+                switch (state) {
+                    case State::FieldStart:
+                        if (*p == '"') {
+                            state = State::Quoted;
+                            p++;
+                        } else {
+                            state = State::Unquoted;
+                        }
+                        break;
+                    case State::Unquoted: {
+                        const char* stop = std::find_if(p, end, isSeparator);
+                        if (stop == end) {
+                            field.append(p, end);
+                        } else if (field.empty()) {
+                            separate(std::string_view(p, stop - p), false, *stop);
+                        } else {
+                            field.append(p, stop);
+                            separate(field, false, *stop);
+                        }
+                        p = stop == end ? end : stop + 1;
+                        break;
+                    }
+                    case State::Quoted: {
+                        const char* quote = std::find(p, end, '"');
+                        field.append(p, quote);
+                        if (quote != end)
+                            state = State::QuoteInQuoted;
+                        p = quote == end ? end : quote + 1;
+                        break;
+                    }
+                    case State::QuoteInQuoted:
+                        if (*p == '"') {
+                            field += '"';
+                            state = State::Quoted;
+                        } else if (isSeparator(*p)) {
+                            separate(field, true, *p);
+                        } else {
+                            return false;
+                        }
+                        p++;
+                        break;
+                }
+            }
+        }
+        if (is.bad() || state == State::Quoted)
+            return false;
+        if (state != State::FieldStart || col != origin.getCol())
+            store(field, state == State::QuoteInQuoted);
+
+        staged.invalidate(keys);
+        *this = staged;
+        return true;
+    }
+
+    //Evaluates all dirty formulas, found in the list invalidate collects, so the cost follows the edits and not the
+    //size of the sheet. They are grouped into topological levels of the dependency graph, the cells of a level only
+    //read cells of the earlier levels, so each level is evaluated in parallel on the thread pool and no evaluation
+    //recurses. Cells on or depending on a cycle stay undefined.
+    void recalculateAll() {
+        std::vector<const Cell*> dirty;
+        std::vector<std::pair<int, int>> keys;
+        std::unordered_map<uint64_t, uint32_t> index;
+        for (const auto& key : dirtyFormulas) {
+            const Cell* cell = std::as_const(cells).find(key);
+            if (cell && cell->getProgram() && cell->isDirty() && !cell->isCyclic()
+                && index.emplace(cellKey(key), static_cast<uint32_t>(dirty.size())).second) {
+                dirty.push_back(cell);
+                keys.push_back(key);
+            }
+        }
+        dirtyFormulas.clear();
+
+        //Edges from every dirty precedent to its dirty dependents, the clean cells are already evaluated
+        std::vector<std::vector<uint32_t>> dependentsOf(dirty.size());
+        std::vector<uint32_t> pending(dirty.size(), 0);
+        for (uint32_t i = 0; i < dirty.size(); i++) {
+            auto link = [&](const std::pair<int, int>& precedent) {
+                auto it = index.find(cellKey(precedent));
+                if (it != index.end()) {
+                    dependentsOf[it->second].push_back(i);
+                    pending[i]++;
+                }
+            };
+            const Program& program = *dirty[i]->getProgram();
+            for (const auto& ref : program.getReferences(keys[i])) {
+                link(ref);
+            }
+            for (const auto& range : program.getRanges(keys[i])) {
+                cells.forEachFormula(range, link);
+            }
+        }
+
+        std::vector<uint32_t> level;
+        for (uint32_t i = 0; i < dirty.size(); i++) {
+            if (!pending[i])
+                level.push_back(i);
+        }
+        std::vector<uint32_t> next;
+        while (!level.empty()) {
+            ThreadPool::shared().parallelFor(level.size(), [&](size_t i) { dirty[level[i]]->evaluate(cells); });
+            next.clear();
+            for (uint32_t i : level) {
+                for (uint32_t dependent : dependentsOf[i]) {
+                    if (--pending[dependent] == 0)
+                        next.push_back(dependent);
+                }
+            }
+            std::swap(level, next);
+        }
+    }
+
+    //Writes the sheet in the text format (see TEXT_HEADER). The lines are collected in a buffer written in large chunks.
+    bool save(std::ostream &os) const {
+        try {
+            std::string buffer;
+            buffer.reserve(TEXT_BUFFER + 4096);
+            uint32_t crc = 0;
+            size_t lines = 0;
+            auto flush = [&os, &buffer]() {
+                os.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                buffer.clear();
+            };
+            auto endBlock = [&buffer, &crc, &lines]() {
+                buffer += '#';
+                appendNumber(buffer, lines);
+                buffer += ' ';
+                appendNumber(buffer, crc, 16);
+                buffer += '\n';
+                crc = 0;
+                lines = 0;
+            };
+
+            buffer += TEXT_HEADER;
+            buffer += '\n';
+            //Formula text is decompiled into this one buffer, reused for all the cells
+            std::string formula;
+            cells.forEach([&](const std::pair<int, int> &key, const Cell &cell) {
+                size_t start = buffer.size();
+                appendColumn(buffer, key.second);
+                buffer += '|';
+                appendNumber(buffer, key.first);
+                buffer += '|';
+                if (const auto& program = cell.getProgram()) {
+                    formula.assign(1, '=');
+                    program->write(formula, cell.getAnchor());
+                    appendEscaped(buffer, formula);
+                } else if (const double* number = cell.getNumber()) {
+                    char digits[32];
+                    auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), *number);
+                    buffer.append(digits, end);
+                } else if (const InternedString* text = cell.getText()) {
+                    buffer += '\'';
+                    appendEscaped(buffer, **text);
+                }
+                buffer += '\n';
+                crc = crc32(buffer.data() + start, buffer.size() - start, crc);
+                if (++lines == TEXT_BLOCK_LINES)
+                    endBlock();
+                if (buffer.size() >= TEXT_BUFFER)
+                    flush();
+            });
+            endBlock();
+            buffer += TEXT_END;
+            buffer += '\n';
+            flush();
+            return static_cast<bool>(os);
+        }
+        catch (...) {
+            return false;
+        }
     }
 
-    void opGe() override {
-        auto right = popNode();
-        auto left = popNode();
-        nodes.push(std::make_shared<GeNode>(left, right));
+    //Writes the sheet in the binary format (see BinaryHeader): the values are stored as they are and the formulas as
+    //their compiled programs, so loading parses nothing
+    bool saveBinary(std::ostream& os) const {
+        BinaryHeader header{};
+        std::vector<CellRecord> records;
+        std::vector<double> numbers;
+        std::vector<std::pair<uint32_t, uint32_t>> strings;
+        std::string chars;
+        std::unordered_map<const std::string*, uint32_t> stringIndex;
+        std::vector<const Program*> programList;
+        std::unordered_map<const Program*, uint32_t> programIndex;
+
+        records.reserve(cells.size());
+        cells.forEach([&](const std::pair<int, int>& key, const Cell& cell) {
+            CellRecord record{key.first, key.second, CellRecord::Empty, 0};
+            if (const auto& program = cell.getProgram()) {
+                //Shared programs are stored once
+                auto [it, added] = programIndex.try_emplace(program.get(), static_cast<uint32_t>(programList.size()));
+                if (added)
+                    programList.push_back(program.get());
+                record.kind = CellRecord::Formula;
+                record.index = it->second;
+            } else if (const double* number = cell.getNumber()) {
+                record.kind = CellRecord::Number;
+                record.index = static_cast<uint32_t>(numbers.size());
+                numbers.push_back(*number);
+            } else if (const InternedString* text = cell.getText()) {
+                //Interned texts are stored once, like the programs
+                auto [it, added] = stringIndex.try_emplace(&**text, static_cast<uint32_t>(strings.size()));
+                if (added) {
+                    strings.emplace_back(static_cast<uint32_t>(chars.size()), static_cast<uint32_t>((*text)->size()));
+                    chars += **text;
+                }
+                record.kind = CellRecord::String;
+                record.index = it->second;
+            }
+            records.push_back(record);
+        });
+
+        //Every section starts 8 byte aligned, so a mapped image can be read in place
+        uint64_t offset = sizeof(BinaryHeader);
+        auto place = [&offset](uint64_t& start, size_t bytes) {
+            start = offset;
+            offset = (offset + bytes + 7) & ~uint64_t(7);
+        };
+        header.cellCount = records.size();
+        header.numberCount = numbers.size();
+        header.stringCount = strings.size();
+        header.programCount = programList.size();
+        place(header.cells, records.size() * sizeof(CellRecord));
+        place(header.numbers, numbers.size() * sizeof(double));
+        place(header.strings, strings.size() * sizeof(strings[0]));
+        //The program section starts with the offset of each program, the end of the last one is the end of the section
+        size_t programBytes = (programList.size() + 1) * sizeof(uint64_t);
+        for (const Program* program : programList) {
+            programBytes += (program->serializedSize() + 7) & ~size_t(7);
+        }
+        place(header.programs, programBytes);
+        place(header.chars, chars.size());
+        header.size = offset;
+
+        std::vector<std::byte> image(offset);
+        auto put = [&image](uint64_t at, const void* data, size_t bytes) {
+            if (bytes)
+                std::memcpy(image.data() + at, data, bytes);
+        };
+        put(header.cells, records.data(), records.size() * sizeof(CellRecord));
+        put(header.numbers, numbers.data(), numbers.size() * sizeof(double));
+        put(header.strings, strings.data(), strings.size() * sizeof(strings[0]));
+        uint64_t programOffset = header.programs + (programList.size() + 1) * sizeof(uint64_t);
+        for (size_t i = 0; i <= programList.size(); i++) {
+            put(header.programs + i * sizeof(uint64_t), &programOffset, sizeof(uint64_t));
+            if (i < programList.size()) {
+                programList[i]->serialize(image.data() + programOffset);
+                programOffset += (programList[i]->serializedSize() + 7) & ~size_t(7);
+            }
+        }
+        put(header.chars, chars.data(), chars.size());
+
+        std::memcpy(header.magic, BinaryHeader::MAGIC, sizeof(header.magic));
+        header.version = BinaryHeader::VERSION;
+        header.checksum = binaryChecksum(header, image);
+        put(0, &header, sizeof(BinaryHeader));
+        os.write(reinterpret_cast<const char*>(image.data()), static_cast<std::streamsize>(image.size()));
+        return static_cast<bool>(os);
     }
 
-    void valReference(std::string val) override {
-        bool isRowAbsolute = false;
-        bool isColAbsolute = false;
-        int row = 0, col = 0;
-        long unsigned int idx = 0;
+    bool loadBinary(std::istream& is) {
+        std::string image{std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>()};
+        return loadBinary(std::as_bytes(std::span(image)));
+    }
 
-        if (val[idx] == '$') {
-            isColAbsolute = true;
-            idx++;
-        }
-        std::string colPart;
-        while (std::isalpha(val[idx])) {
-            colPart += std::toupper(val[idx++]);
-        }
-        for (char ch: colPart) {
-            col = col * 26 + (ch - 'A' + 1);
-        }
-        if (idx < val.size() && val[idx] == '$') {
-            isRowAbsolute = true;
-            idx++;
+    //Loads a sheet image written by saveBinary, e.g. a memory mapped file. The image is only read, so it may be
+    //unaligned, and a corrupted image fails the checksum. The sheet is left unchanged on failure.
+    bool loadBinary(std::span<const std::byte> image) {
+        BinaryHeader header;
+        if (image.size() < sizeof(BinaryHeader))
+            return false;
+        std::memcpy(&header, image.data(), sizeof(BinaryHeader));
+        if (std::memcmp(header.magic, BinaryHeader::MAGIC, sizeof(header.magic)) != 0 || header.version != BinaryHeader::VERSION ||
+            header.size != image.size() ||
+            header.checksum != binaryChecksum(header, image))
+            return false;
+        auto section = [&image](uint64_t start, uint64_t count, size_t itemSize) {
+            return start <= image.size() && count <= (image.size() - start) / itemSize;
+        };
+        if (!section(header.cells, header.cellCount, sizeof(CellRecord)) ||
+            !section(header.numbers, header.numberCount, sizeof(double)) ||
+            !section(header.strings, header.stringCount, 2 * sizeof(uint32_t)) ||
+            !section(header.programs, header.programCount + 1, sizeof(uint64_t)) || header.chars > image.size())
+            return false;
+        auto read = [&image](uint64_t at, auto& value) {
+            std::memcpy(&value, image.data() + at, sizeof(value));
+        };
+
+        std::vector<std::shared_ptr<const Program>> programList;
+        programList.reserve(header.programCount);
+        for (uint64_t i = 0; i < header.programCount; i++) {
+            uint64_t start, end;
+            read(header.programs + i * sizeof(uint64_t), start);
+            read(header.programs + (i + 1) * sizeof(uint64_t), end);
+            if (start > end || end > image.size())
+                return false;
+            auto program = Program::deserialize(image.subspan(start, end - start));
+            if (!program)
+                return false;
+            programList.push_back(programs->intern(std::move(program)));
         }
 
-        std::string rowPart;
-        while (idx < val.size() && std::isdigit(val[idx])) {
-            rowPart += val[idx++];
+        CSpreadsheet loaded;
+        loaded.programs = programs;
+        loaded.cells.shareStrings(cells);
+        std::vector<InternedString> stringList(header.stringCount);
+        std::vector<std::pair<int, int>> keys;
+        keys.reserve(header.cellCount);
+        for (uint64_t i = 0; i < header.cellCount; i++) {
+            CellRecord record;
+            read(header.cells + i * sizeof(CellRecord), record);
+            std::pair<int, int> key = {record.row, record.col};
+            if (record.row < 0 || record.col < 1 || std::as_const(loaded.cells).find(key))
+                return false;
+            Cell cell;
+            if (record.kind == CellRecord::Formula) {
+                if (record.index >= programList.size())
+                    return false;
+                cell.setProgram(programList[record.index], key);
+            } else if (record.kind == CellRecord::Number) {
+                if (record.index >= header.numberCount)
+                    return false;
+                double number;
+                read(header.numbers + record.index * sizeof(double), number);
+                cell.setValue(number);
+            } else if (record.kind == CellRecord::String) {
+                if (record.index >= header.stringCount)
+                    return false;
+                uint32_t slice[2];
+                read(header.strings + record.index * sizeof(slice), slice);
+                if (slice[0] > image.size() - header.chars || slice[1] > image.size() - header.chars - slice[0])
+                    return false;
+                InternedString& text = stringList[record.index];
+                if (!text)
+                    text = cells.intern({reinterpret_cast<const char*>(image.data() + header.chars + slice[0]), slice[1]});
+                cell.setValue(text);
+            } else if (record.kind != CellRecord::Empty) {
+                return false;
+            }
+            loaded.cells.assign(key, std::move(cell));
+            loaded.linkCell(key);
+            keys.push_back(key);
         }
-        row = static_cast<int>(std::stoul(rowPart));
-
-        nodes.push(std::make_shared<ReferenceNode>(row, col, isRowAbsolute, isColAbsolute, originRow, originCol));
+        //Every cell of a new sheet is dirty and affected, only the cycles have to be found
+        loaded.dirtyFormulas = keys;
+        loaded.updateCycles({keys.begin(), keys.end()});
+        *this = loaded;
+        return true;
     }
 
-    void valRange(std::string val) override {}
+    //Loads a sheet written by save. The file is rejected if any block fails its checksum or the end line is missing,
+    //the sheet is left unchanged on failure. The blocks are checked and parsed on the thread pool while the stream is
+    //read, then merged in file order, so the result does not depend on the order the workers finish in.
+    bool load(std::istream &is) {
+        std::deque<TextBlock> blocks;
+        std::vector<std::future<void>> parsed;
+        auto readBlocks = [&]() {
+            LineReader reader(is);
+            std::string_view line;
+            if (!reader.next(line) || line != TEXT_HEADER)
+                return false;
 
-    void funcCall(std::string fnName, int paramCount) override {}
+            std::string pending;
+            size_t lines = 0;
+            bool closed = false;
+            while (true) {
+                if (!reader.next(line) || line.empty())
+                    return false;
+                if (line == TEXT_END)
+                    return closed && !reader.next(line);
+                if (line[0] != '#') {
+                    pending.append(line);
+                    pending += '\n';
+                    lines++;
+                    closed = false;
+                    continue;
+                }
 
-    std::shared_ptr<TreeNode> getRoot() const{
+                TextBlock& block = blocks.emplace_back();
+                const char* end = line.data() + line.size();
+                auto [countEnd, countError] = std::from_chars(line.data() + 1, end, block.lines);
+                if (countError != std::errc() || countEnd == end || *countEnd != ' ')
+                    return false;
+                auto [crcEnd, crcError] = std::from_chars(countEnd + 1, end, block.crc, 16);
+                if (crcError != std::errc() || crcEnd != end || block.lines != lines)
+                    return false;
+                block.text = std::move(pending);
+                pending = std::string();
+                lines = 0;
+                closed = true;
+                parsed.push_back(ThreadPool::shared().submit([this, &block]() { parseBlock(block); }));
+            }
+        };
 
-        return nodes.top();
-    }
+        bool complete = false;
+        try {
+            complete = readBlocks();
+        } catch (...) {
+        }
+        //The workers reference the blocks, so every task has to finish before they go away
+        for (auto& task : parsed) {
+            try {
+                task.get();
+            } catch (...) {
+                complete = false;
+            }
+        }
+        if (!complete)
+            return false;
 
-    void setOrigin(int row, int col) {
-        originRow = row;
-        originCol = col;
+        try {
+            CSpreadsheet loaded;
+            loaded.programs = programs;
+            loaded.cells.shareStrings(cells);
+            std::vector<std::pair<int, int>> keys;
+            for (auto& block : blocks) {
+                if (!block.parsed)
+                    return false;
+                for (auto& [key, cell] : block.cells) {
+                    loaded.placeCell(key, std::move(cell));
+                    keys.push_back(key);
+                }
+            }
+            loaded.dirtyFormulas = keys;
+            loaded.updateCycles({keys.begin(), keys.end()});
+            *this = loaded;
+            return true;
+        } catch (...) {
+            return false;
+        }
     }
 
 private:
-    std::shared_ptr<TreeNode> popNode() {
-        auto node = nodes.top();
-        nodes.pop();
-        return node;
+    //Header of the binary format. The sections follow at the given offsets: the cell records, the numbers of the number
+    //cells, the slices of the string cells, the serialized programs of the formulas and the characters of the strings.
+    //Everything is in the byte order of the writer, a foreign byte order does not match the version. The checksum is
+    //the CRC-32 of the header, with the checksum itself as 0, and of everything after it.
+    struct BinaryHeader {
+        static constexpr char MAGIC[8] = {'F', 'I', 'T', 'S', 'H', 'E', 'E', 'T'};
+        static constexpr uint32_t VERSION = 1;
+
+        char magic[8];
+        uint32_t version;
+        uint32_t checksum;
+        uint64_t size;
+        uint64_t cellCount, numberCount, stringCount, programCount;
+        uint64_t cells, numbers, strings, programs, chars;
+    };
+
+    static uint32_t binaryChecksum(BinaryHeader header, std::span<const std::byte> image) {
+        header.checksum = 0;
+        uint32_t crc = crc32(&header, sizeof(BinaryHeader));
+        return crc32(image.data() + sizeof(BinaryHeader), image.size() - sizeof(BinaryHeader), crc);
     }
 
-    int originRow, originCol;
-};
-
-// Definition of various Cell Class methods
-void Cell::setValue(const CValue &val) {
-    value = val;
-    expressionTree = nullptr;
-}
-
-void Cell::setExpressionTree(std::shared_ptr<TreeNode> tree, const std::string& expr) {
-    expressionTree = std::move(tree);
-    expressionString = expr;
-    value = std::monostate();
-}
-
-CValue Cell::evaluate(const std::map<std::pair<int, int>, std::shared_ptr<Cell>>& context) {
-    if (expressionTree) {
-        return expressionTree->calculate(context);
+    //A cell of the binary format, index points to its number, string or program
+    struct CellRecord {
+        enum Kind : uint32_t { Empty, Number, String, Formula };
+
+        int32_t row;
+        int32_t col;
+        uint32_t kind;
+        uint32_t index;
+    };
+
+    //Cell lines of the text format up to a #count crc line, and the cells parsed from them
+    struct TextBlock {
+        std::string text;
+        size_t lines = 0;
+        uint32_t crc = 0;
+        std::vector<std::pair<std::pair<int, int>, Cell>> cells;
+        bool parsed = false;
+    };
+
+    //Checks the checksum of block and parses its lines, block.parsed is set only if all lines are valid. Runs on a
+    //worker, it only reads the sheet (see compileFormula).
+    void parseBlock(TextBlock& block) const {
+        if (crc32(block.text.data(), block.text.size()) != block.crc)
+            return;
+        std::string content;
+        block.cells.reserve(block.lines);
+        std::string_view text = block.text;
+        for (size_t start = 0, newline; start < text.size(); start = newline + 1) {
+            newline = text.find('\n', start);
+            std::string_view line = text.substr(start, newline - start);
+            std::pair<int, int> key;
+            size_t pos = 0;
+            Cell cell;
+            if (!parseCellKey(line, pos, key) || !unescape(line.substr(pos), content))
+                return;
+            if (!content.empty() && content[0] == '=') {
+                if (!compileFormula(key, content, cell))
+                    return;
+            } else if (!content.empty() && content[0] == '\'') {
+                cell.setValue(cells.intern(std::string_view(content).substr(1)));
+            } else if (!content.empty()) {
+                double number = 0;
+                if (!parseLiteral(content, number))
+                    return;
+                cell.setValue(number);
+            }
+            block.cells.emplace_back(key, std::move(cell));
+        }
+        block.parsed = true;
     }
-    return value;
-}
 
-std::shared_ptr<Cell> Cell::clone() const {
-    auto newCell = std::make_shared<Cell>();
-    newCell->value = value;
-    if (expressionTree) {
-        newCell->expressionTree = expressionTree->clone();
+    //Text format: the header line, then a line COL|ROW|content per cell. The content is empty for an empty cell, a
+    //number, ' and a string, or = and a formula, with backslash, newline and carriage return escaped by a backslash.
+    //After every TEXT_BLOCK_LINES cell lines and at the end, a line #count crc gives the number of cell lines of the
+    //block and their CRC-32 in hex, and the end line closes the file, so corruption and truncation are detected.
+    static constexpr std::string_view TEXT_HEADER = "FITSHEET 1";
+    static constexpr std::string_view TEXT_END = "end";
+    static constexpr size_t TEXT_BLOCK_LINES = 4096;
+    static constexpr size_t TEXT_BUFFER = 1 << 16;
+    static constexpr size_t CSV_CHUNK = 1 << 20;
+    static constexpr size_t CSV_BATCH = 1 << 16;
+
+    CellGrid cells;
+    std::shared_ptr<ProgramPool> programs = std::make_shared<ProgramPool>();
+    //The references and ranges read by a cell are found in its program, only the reverse edges are indexed: cells
+    //referencing a cell (see cellKey), and cells reading a range, keyed by column and by aligned spans of row blocks
+    //(see forEachRangeKey). Ranges needing too many keys are kept under WIDE_RANGE_KEY and checked for every change.
+    DependentIndex dependents;
+    DependentIndex rangeDependents;
+    int maxRangeLevel = -1;
+    //Formulas marked dirty since the last recalculateAll. Entries may repeat or have been evaluated by a read since.
+    std::vector<std::pair<int, int>> dirtyFormulas;
+
+    static constexpr double WIDE_RANGE_KEYS = 4096;
+    static constexpr uint64_t WIDE_RANGE_KEY = ~uint64_t(0);
+
+    template <typename T>
+    static void appendNumber(std::string& out, T value, int base = 10) {
+        char digits[24];
+        auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value, base);
+        out.append(digits, end);
     }
-    return newCell;
-}
 
-std::shared_ptr<TreeNode> Cell::getExpressionTree() const {
-    return expressionTree;
-}
-
-
-// Class representing a Spreadsheet
-class CSpreadsheet {
-public:
-    static unsigned capabilities() {
-              return SPREADSHEET_CYCLIC_DEPS;
+    //Reads text as a number when the whole of it is one. The syntax is that of std::stod: leading whitespace, a sign
+    //and hexadecimal numbers such as 0x1A are accepted. A value out of the range of double or trailing characters, as
+    //in 12abc, make it a string.
+    static bool parseLiteral(std::string_view text, double& number) {
+        size_t pos = 0;
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+            pos++;
+        bool negative = false;
+        if (pos < text.size() && (text[pos] == '+' || text[pos] == '-'))
+            negative = text[pos++] == '-';
+        std::chars_format format = std::chars_format::general;
+        if (text.size() - pos > 2 && text[pos] == '0' && (text[pos + 1] == 'x' || text[pos + 1] == 'X')) {
+            format = std::chars_format::hex;
+            pos += 2;
+        }
+        //from_chars takes a minus sign of its own, which must not follow the one already read
+        if (pos == text.size() || text[pos] == '+' || text[pos] == '-')
+            return false;
+        auto [end, ec] = std::from_chars(text.data() + pos, text.data() + text.size(), number, format);
+        if (ec != std::errc() || end != text.data() + text.size())
+            return false;
+        if (negative)
+            number = -number;
+        return true;
     }
 
-    CSpreadsheet() = default;
-
-    CSpreadsheet(const CSpreadsheet& other) {
-        for (const auto& [key, cell] : other.cells) {
-            cells[key] = cell->clone();
+    static void appendColumn(std::string& out, int col) {
+        char letters[8];
+        char* start = letters + sizeof(letters);
+        while (col > 0) {
+            *--start = static_cast<char>('A' + (col - 1) % 26);
+            col = (col - 1) / 26;
         }
+        out.append(start, letters + sizeof(letters));
     }
 
-    CSpreadsheet(CSpreadsheet&& other) noexcept : cells(std::move(other.cells)) {}
-
-    CSpreadsheet& operator=(const CSpreadsheet& other) {
-        if (this == &other) return *this;
-
-        cells.clear();
-        for (const auto& [key, cell] : other.cells) {
-            cells[key] = cell->clone();
+    static void appendEscaped(std::string& out, std::string_view text) {
+        for (char ch : text) {
+            if (ch == '\\') {
+                out += "\\\\";
+            } else if (ch == '\n') {
+                out += "\\n";
+            } else if (ch == '\r') {
+                out += "\\r";
+            } else {
+                out += ch;
+            }
         }
-        return *this;
     }
 
-    CSpreadsheet& operator=(CSpreadsheet&& other) noexcept {
-        cells = std::move(other.cells);
-        return *this;
+    //Reverses appendEscaped, fails on an unknown escape
+    static bool unescape(std::string_view text, std::string& out) {
+        out.clear();
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] != '\\') {
+                out += text[i];
+            } else if (++i < text.size() && (text[i] == '\\' || text[i] == 'n' || text[i] == 'r')) {
+                out += text[i] == 'n' ? '\n' : text[i] == 'r' ? '\r' : '\\';
+            } else {
+                return false;
+            }
+        }
+        return true;
     }
 
-    bool setCell(const CPos &pos, const std::string &contents) {
-        std::pair<int, int> key = {pos.getRow(), pos.getCol()};
-        auto &cell = cells[key];
-        if (!cell) {
-            cell = std::make_shared<Cell>();
+    //Parses the COL|ROW| prefix of a line of the text format, pos is moved past it
+    static bool parseCellKey(std::string_view line, size_t& pos, std::pair<int, int>& key) {
+        long long col = 0;
+        while (pos < line.size() && std::isalpha(static_cast<unsigned char>(line[pos]))) {
+            col = col * 26 + (std::toupper(static_cast<unsigned char>(line[pos++])) - 'A' + 1);
+            if (col > std::numeric_limits<int>::max())
+                return false;
         }
+        if (col == 0 || pos >= line.size() || line[pos] != '|' || ++pos >= line.size() ||
+            !std::isdigit(static_cast<unsigned char>(line[pos])))
+            return false;
+        auto [end, ec] = std::from_chars(line.data() + pos, line.data() + line.size(), key.first);
+        pos = end - line.data();
+        if (ec != std::errc() || pos >= line.size() || line[pos] != '|')
+            return false;
+        pos++;
+        key.second = static_cast<int>(col);
+        return true;
+    }
 
-        if (contents.empty()) {
-            cell->setValue(std::monostate());
-            return true;
-        }
+    //Parses contents and stores them into the cell at key together with its dependency edges, the cell is left
+    //unchanged on failure
+    bool storeCell(const std::pair<int, int>& key, const std::string &contents) {
+        Cell cell;
+        if (!compileCell(key, contents, cell))
+            return false;
+        placeCell(key, std::move(cell));
+        return true;
+    }
 
-        if (contents[0] == '=') {
-            TreeBuilder builder;
-            builder.setOrigin(pos.getRow(), pos.getCol());
-            try {
-                parseExpression(contents, builder);
-                cell->setExpressionTree(builder.getRoot(), contents);
-            } catch (const std::exception &e) {
-                cell->setExpressionTree(nullptr, "");
-                return false;
-            }
+    //Parses the contents of the cell at key into cell, returns false when they are an invalid expression. Only reads
+    //the sheet, see compileFormula.
+    bool compileCell(const std::pair<int, int>& key, const std::string &contents, Cell& cell) const {
+        if (contents.empty()) {
+            cell = Cell();
+        } else if (contents[0] == '=') {
+            return compileFormula(key, contents, cell);
         } else {
-            try {
-                double num = std::stod(contents);
-                cell->setValue(num);
-            } catch (const std::invalid_argument &) {
-                cell->setValue(contents);
+            double number = 0;
+            if (parseLiteral(contents, number)) {
+                cell.setValue(number);
+            } else {
+                cell.setValue(cells.intern(contents));
             }
         }
         return true;
     }
 
+    //Compiles the formula contents of the cell at key into cell, returns false when it is not a valid expression. The
+    //sheet is only read and the program pool is locked, so formulas can be compiled on several threads.
+    bool compileFormula(const std::pair<int, int>& key, std::string_view contents, Cell& cell) const {
+        //The builder is reused, so its pools keep their capacity and parsing a formula does not allocate
+        thread_local TreeBuilder builder;
+        builder.reset(key);
+        try {
+            ExpressionParser::parse(contents, builder);
+            cell.setProgram(programs->intern(builder.getProgram()), key);
+        } catch (const std::exception &e) {
+            return false;
+        }
+        return true;
+    }
 
+    //Stores cell at key, replacing the dependency edges of the previous cell with its own
+    void placeCell(const std::pair<int, int>& key, Cell cell) {
+        unlinkCell(key);
+        cells.assign(key, std::move(cell));
+        linkCell(key);
+    }
 
-
-    CValue getValue(CPos pos) {
-        std::pair<int, int> key = {pos.getRow(), pos.getCol()};
-
-        auto it = cells.find(key);
-        if (it == cells.end()) {
-            return std::monostate();
+    //Removes the dependency edges of the current expression of cellId, before the cell is overwritten
+    void unlinkCell(const std::pair<int, int>& cellId) {
+        const Cell* cell = std::as_const(cells).find(cellId);
+        if (!cell || !cell->getProgram())
+            return;
+        const Program& program = *cell->getProgram();
+        for (const auto& ref : program.getReferences(cellId)) {
+            dependents.erase(cellKey(ref), cellId);
         }
-
-        std::set<std::pair<int, int>> visited, recStack;
-        if (detectCycle(key, visited, recStack)) {
-            return std::monostate();
+        for (const auto& range : program.getRanges(cellId)) {
+            if (!forEachRangeKey(range, [this, &cellId](uint64_t key) { rangeDependents.erase(key, cellId); }))
+                rangeDependents.erase(WIDE_RANGE_KEY, cellId);
         }
-
-        return it->second->evaluate(cells);
     }
 
+    //Adds the dependency edges of the references and ranges of the current expression of cellId
+    void linkCell(const std::pair<int, int>& cellId) {
+        const Cell* cell = std::as_const(cells).find(cellId);
+        if (!cell || !cell->getProgram())
+            return;
+        const Program& program = *cell->getProgram();
+        for (const auto& ref : program.getReferences(cellId)) {
+            dependents.insert(cellKey(ref), cellId);
+        }
+        for (const auto& range : program.getRanges(cellId)) {
+            if (!forEachRangeKey(range, [this, &cellId](uint64_t key) { rangeDependents.insert(key, cellId); }))
+                rangeDependents.insert(WIDE_RANGE_KEY, cellId);
+        }
+    }
 
-    void copyRect(CPos dst, CPos src, int w = 1, int h = 1) {
-        int srcRow = src.getRow();
-        int srcCol = src.getCol();
-        int dstRow = dst.getRow();
-        int dstCol = dst.getCol();
-        int rowOffset = dstRow - srcRow;
-        int colOffset = dstCol - srcCol;
-
-        std::map<std::pair<int, int>, std::shared_ptr<Cell>> tempStorage;
-
-        for (int r = 0; r < h; ++r) {
-            for (int c = 0; c < w; ++c) {
-                std::pair<int, int> srcPos = {srcRow + r, srcCol + c};
-                std::pair<int, int> dstPos = {dstRow + r, dstCol + c};
-
-                auto srcIt = cells.find(srcPos);
-                if (srcIt != cells.end()) {
-                    tempStorage[dstPos] = srcIt->second->clone();
-                    if (auto exprTree = tempStorage[dstPos]->getExpressionTree()) {
-                        auto adjustedTree = exprTree->adjustReferences(rowOffset, colOffset);
-                        std::string newExpr = adjustedTree->toString();
-
-                        tempStorage[dstPos]->setExpressionTree(adjustedTree, "="+newExpr);
-                    }
-                } else {
-
-                        tempStorage[dstPos] = std::make_shared<Cell>();
-                        tempStorage[dstPos]->setValue(std::monostate());
+    //Key of a cell in the dependents index, column major so that the cells of a column segment share a shard
+    static uint64_t cellKey(const std::pair<int, int>& cellId) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(cellId.second)) << 32) | static_cast<uint32_t>(cellId.first);
+    }
 
-                }
+    //Calls fn with the index keys of range. The rows of the range are split into aligned power-of-two spans of 64 row
+    //blocks, the nodes of a segment tree, so even a very tall range needs O(log n) keys per column and a cell finds
+    //all ranges covering it by probing one span per level. Returns false without calling fn when too many keys are needed.
+    template <typename Fn>
+    bool forEachRangeKey(const CellRange& range, Fn&& fn) {
+        if (range.to.first < 0 || range.to.second < 0)
+            return true;
+        int firstCol = std::max(range.from.second, 0);
+        std::vector<std::pair<int, int>> spans;
+        int low = std::max(range.from.first, 0) >> CellGrid::BLOCK_BITS;
+        int high = (range.to.first >> CellGrid::BLOCK_BITS) + 1;
+        for (int level = 0; low < high; low >>= 1, high >>= 1, level++) {
+            if (low & 1)
+                spans.emplace_back(level, low++);
+            if (high & 1)
+                spans.emplace_back(level, --high);
+        }
+        if (static_cast<double>(spans.size()) * (static_cast<double>(range.to.second) - firstCol + 1) > WIDE_RANGE_KEYS)
+            return false;
+        for (int col = firstCol; col <= range.to.second; col++) {
+            for (const auto& [level, span] : spans) {
+                maxRangeLevel = std::max(maxRangeLevel, level);
+                fn(rangeKey(level, span, col));
             }
         }
+        return true;
+    }
 
-        for (const auto& [pos, cell] : tempStorage) {
-            cells[pos] = cell;
-        }
+    static uint64_t rangeKey(int level, int span, int col) {
+        return (static_cast<uint64_t>(level) << 58) | (static_cast<uint64_t>(span) << 32) | static_cast<uint32_t>(col);
     }
 
+    //Collects the cells whose values the expression of cellId reads: direct references and formulas inside its ranges.
+    //Literal cells inside a range are left out, they can neither be dirty nor take part in a cycle.
+    std::vector<std::pair<int, int>> readCells(const std::pair<int, int>& cellId) const {
+        std::vector<std::pair<int, int>> result;
+        const Cell* cell = cells.find(cellId);
+        if (!cell || !cell->getProgram())
+            return result;
+        auto refs = cell->getProgram()->getReferences(cellId);
+        result.assign(refs.begin(), refs.end());
+        for (const auto& range : cell->getProgram()->getRanges(cellId)) {
+            cells.forEachFormula(range, [&result](const std::pair<int, int>& formula) { result.push_back(formula); });
+        }
+        return result;
+    }
 
-    bool save(std::ostream &os) const {
-        try {
-            for (const auto &[key, cell]: cells) {
-                int row = key.first;
-                int col = key.second;
+    //Marks the changed cells and every cell that transitively depends on them as dirty, so their cached values are
+    //recomputed on the next read, and refreshes the cycle flags of exactly these cells
+    void invalidate(const std::vector<std::pair<int, int>>& changed) {
+        std::set<std::pair<int, int>> affected(changed.begin(), changed.end());
+        std::vector<std::pair<int, int>> pending(changed.begin(), changed.end());
+        while (!pending.empty()) {
+            auto current = pending.back();
+            pending.pop_back();
+            if (const auto* direct = dependents.find(cellKey(current))) {
+                for (const auto& dependent : *direct) {
+                    if (affected.insert(dependent).second) {
+                        pending.push_back(dependent);
+                    }
+                }
+            }
 
-                if (cell->getExpressionTree()) {
-                    std::string expr = cell->getExpressionString();
-                    os << columnIndexToLabel(col) << "|" << std::to_string(row) << "|" << expr << std::endl;
-                } else {
-                    const CValue &value = cell->getValue();
-                    os << columnIndexToLabel(col) << "|" << std::to_string(row) << "|";
-                    if (std::holds_alternative<double>(value)) {
-                        os << std::get<double>(value) << std::endl;
-                    } else if (std::holds_alternative<std::string>(value)) {
-                        os << std::get<std::string>(value) << std::endl;
-                    } else if (std::holds_alternative<std::monostate>(value)) {
-                        os << "" << std::endl;
+            auto readsCurrent = [this, &current](const std::pair<int, int>& dependent) {
+                for (const auto& range : std::as_const(cells).find(dependent)->getProgram()->ranges()) {
+                    if (range.cells(dependent).contains(current))
+                        return true;
+                }
+                return false;
+            };
+            auto visitCandidates = [&](const DependentIndex::CellSet* candidates) {
+                if (!candidates)
+                    return;
+                for (const auto& dependent : *candidates) {
+                    if (!affected.count(dependent) && readsCurrent(dependent)) {
+                        affected.insert(dependent);
+                        pending.push_back(dependent);
                     }
                 }
+            };
+            int block = current.first >> CellGrid::BLOCK_BITS;
+            for (int level = 0; level <= maxRangeLevel; level++) {
+                visitCandidates(rangeDependents.find(rangeKey(level, block >> level, current.second)));
             }
-            return true;
+            visitCandidates(rangeDependents.find(WIDE_RANGE_KEY));
         }
-        catch (...) {
-            return false;
+        //Only formulas cache a value, the blocks of the other cells are left shared
+        for (const auto& cellId : affected) {
+            if (hasProgram(cellId)) {
+                cells.find(cellId)->markDirty();
+                dirtyFormulas.push_back(cellId);
+            }
+        }
+        //A sheet read only through getValue never drains the list, its stale entries are dropped once it outgrows the sheet
+        if (dirtyFormulas.size() > 2 * cells.size() + 1024) {
+            std::sort(dirtyFormulas.begin(), dirtyFormulas.end());
+            dirtyFormulas.erase(std::unique(dirtyFormulas.begin(), dirtyFormulas.end()), dirtyFormulas.end());
+            std::erase_if(dirtyFormulas, [this](const std::pair<int, int>& cellId) {
+                const Cell* cell = std::as_const(cells).find(cellId);
+                return !cell || !cell->isDirty();
+            });
         }
+        updateCycles(affected);
     }
 
+    bool hasProgram(const std::pair<int, int>& cellId) const {
+        const Cell* cell = cells.find(cellId);
+        return cell && cell->getProgram();
+    }
 
-    bool load(std::istream &is) {
-        try {
-            this->cells.clear();
-            std::string line;
-            while (std::getline(is, line)) {
-                if (line.empty()) {
+    bool isCyclic(const std::pair<int, int>& cellId) const {
+        const Cell* cell = cells.find(cellId);
+        return cell && cell->isCyclic();
+    }
+
+    //Only cells that reach an edited cell can gain or lose a path to a cycle, so the strongly connected components
+    //are recomputed (iterative Tarjan) on the affected subgraph only. Components are completed precedents first,
+    //therefore the flags of all precedents are final when a component is decided.
+    void updateCycles(const std::set<std::pair<int, int>>& affected) {
+        struct Frame {
+            std::pair<int, int> cellId;
+            std::vector<std::pair<int, int>> refs;
+            size_t next;
+        };
+        std::map<std::pair<int, int>, int> index, lowLink;
+        std::set<std::pair<int, int>> onStack;
+        std::vector<std::pair<int, int>> sccStack;
+        std::vector<Frame> callStack;
+        int counter = 0;
+
+        //Cells without a formula read nothing and are never cyclic
+        for (const auto& root : affected) {
+            if (index.count(root) || !hasProgram(root))
+                continue;
+            index[root] = lowLink[root] = counter++;
+            sccStack.push_back(root);
+            onStack.insert(root);
+            callStack.push_back({root, readCells(root), 0});
+
+            while (!callStack.empty()) {
+                auto& frame = callStack.back();
+                if (frame.next < frame.refs.size()) {
+                    auto ref = frame.refs[frame.next++];
+                    if (!affected.count(ref) || !hasProgram(ref))
+                        continue;
+                    if (!index.count(ref)) {
+                        index[ref] = lowLink[ref] = counter++;
+                        sccStack.push_back(ref);
+                        onStack.insert(ref);
+                        callStack.push_back({ref, readCells(ref), 0});
+                    } else if (onStack.count(ref)) {
+                        lowLink[frame.cellId] = std::min(lowLink[frame.cellId], index[ref]);
+                    }
                     continue;
                 }
 
-                std::istringstream iss(line);
-                std::string columnId, rowId, value;
-                if (!std::getline(iss, columnId, '|') ||
-                    !std::getline(iss, rowId, '|') ||
-                    !std::getline(iss, value)) {
-                    return false;
+                auto cellId = frame.cellId;
+                auto refs = std::move(frame.refs);
+                callStack.pop_back();
+                if (!callStack.empty()) {
+                    auto& parent = callStack.back().cellId;
+                    lowLink[parent] = std::min(lowLink[parent], lowLink[cellId]);
                 }
+                if (lowLink[cellId] != index[cellId])
+                    continue;
 
-                try {
-                    CPos pos(columnId + rowId);
+                std::vector<std::pair<int, int>> component;
+                do {
+                    component.push_back(sccStack.back());
+                    onStack.erase(sccStack.back());
+                    sccStack.pop_back();
+                } while (component.back() != cellId);
 
-                    setCell(pos, value);
-                } catch (const std::exception &) {
-                    return false;
+                bool cyclic = component.size() > 1 || std::find(refs.begin(), refs.end(), cellId) != refs.end();
+                for (size_t i = 0; i < refs.size() && !cyclic; i++) {
+                    cyclic = isCyclic(refs[i]);
+                }
+                for (const auto& member : component) {
+                    cells.find(member)->setCyclic(cyclic);
                 }
             }
-            return true;
-        } catch (...) {
-            return false;
         }
     }
 
+};
+
 
-private:
-    std::map<std::pair<int, int>, std::shared_ptr<Cell>> cells;
+//A sheet shared by one writer thread and any number of reader threads. The writer edits a private sheet and, after
+//every edit, publishes a fully evaluated copy of it (read-copy-update). Copies share the cell blocks until written,
+//so publishing is O(1) besides evaluating the cells the edit made dirty. Readers take a reference to the latest copy
+//through an atomic shared_ptr, which is not lock-free in libstdc++: the load holds a spin lock for a reference count
+//increment only. The copy is then read without any locking and freed when its last reader drops it. Reading a
+//published copy writes nothing: it has no dirty cells, and the writer unshares every block before it marks cells of
+//the block dirty.
+class ConcurrentSpreadsheet {
+public:
+    ConcurrentSpreadsheet() : published(std::make_shared<const CSpreadsheet>()) {}
 
-    std::string columnIndexToLabel(int col) const {
-        std::string label;
-        while (col > 0) {
-            int remainder = (col - 1) % 26;
-            label = char('A' + remainder) + label;
-            col = (col - 1) / 26;
-        }
-        return label;
+    //Writer side, to be called from one thread at a time
+    bool setCell(const CPos& pos, const std::string& contents) {
+        if (!sheet.setCell(pos, contents))
+            return false;
+        publish();
+        return true;
     }
 
-    bool detectCycle(const std::pair<int, int>& cellId, std::set<std::pair<int, int>>& visited, std::set<std::pair<int, int>>& recStack) {
-        if (recStack.find(cellId) != recStack.end())
-            return true;
-        if (visited.find(cellId) != visited.end())
+    void copyRect(CPos dst, CPos src, int w = 1, int h = 1) {
+        sheet.copyRect(dst, src, w, h);
+        publish();
+    }
+
+    //The readers see either none or all of the edits
+    bool applyEdits(std::span<const CSpreadsheet::Edit> edits) {
+        if (!sheet.applyEdits(edits))
             return false;
-        visited.insert(cellId);
-        recStack.insert(cellId);
-        auto it = cells.find(cellId);
-        if (it != cells.end() && it->second->getExpressionTree()) {
-            auto refs = it->second->getExpressionTree()->getReferences();
-            for (const auto& ref : refs) {
-                if (detectCycle(ref, visited, recStack))
-                    return true;
-            }
-        }
-        recStack.erase(cellId);
-        return false;
+        publish();
+        return true;
     }
 
+    //Reader side, safe to call from any number of threads
+    CValue getValue(CPos pos) const {
+        return published.load()->getValue(pos);
+    }
+
+    //The current version of the sheet, consistent across several reads
+    std::shared_ptr<const CSpreadsheet> snapshot() const {
+        return published.load();
+    }
+
+private:
+    CSpreadsheet sheet;
+    std::atomic<std::shared_ptr<const CSpreadsheet>> published;
+
+    void publish() {
+        sheet.recalculateAll();
+        published.store(std::make_shared<const CSpreadsheet>(sheet));
+    }
 };
 
 
@@ -1266,8 +3879,640 @@ int main() {
     assert (valueMatch(x0.getValue(CPos("H13")), CValue(-22.0)));
     assert (valueMatch(x0.getValue(CPos("H14")), CValue(-22.0)));
 
+    CSpreadsheet x2;
+    assert (x2.setCell(CPos("K0"), "1"));
+    for (int i = 1; i <= 40; i++)
+        assert (x2.setCell(CPos("K" + std::to_string(i)), "=K" + std::to_string(i - 1) + "+K" + std::to_string(i - 1)));
+    assert (valueMatch(x2.getValue(CPos("K40")), CValue(1099511627776.0)));
+    assert (x2.setCell(CPos("K0"), "2"));
+    assert (valueMatch(x2.getValue(CPos("K40")), CValue(2199023255552.0)));
+    assert (!x2.setCell(CPos("K0"), "=1+"));
+    assert (valueMatch(x2.getValue(CPos("K1")), CValue(4.0)));
+    CSpreadsheet x3(x2);
+    assert (x3.setCell(CPos("K0"), "3"));
+    assert (valueMatch(x3.getValue(CPos("K40")), CValue(3298534883328.0)));
+    assert (valueMatch(x2.getValue(CPos("K40")), CValue(2199023255552.0)));
+    x2 = std::move(x3);
+    assert (x2.setCell(CPos("K0"), "1"));
+    assert (valueMatch(x2.getValue(CPos("K40")), CValue(1099511627776.0)));
+
+    assert (x2.setCell(CPos("M1"), "=M2+1"));
+    assert (x2.setCell(CPos("M2"), "=M3*2"));
+    assert (x2.setCell(CPos("M3"), "=M1"));
+    assert (x2.setCell(CPos("M4"), "=M3+10"));
+    assert (valueMatch(x2.getValue(CPos("M1")), CValue()));
+    assert (valueMatch(x2.getValue(CPos("M4")), CValue()));
+    assert (x2.setCell(CPos("M3"), "5"));
+    assert (valueMatch(x2.getValue(CPos("M1")), CValue(11.0)));
+    assert (valueMatch(x2.getValue(CPos("M4")), CValue(15.0)));
+    assert (x2.setCell(CPos("M5"), "=M5"));
+    assert (valueMatch(x2.getValue(CPos("M5")), CValue()));
+    assert (x2.setCell(CPos("M3"), "=M4"));
+    assert (valueMatch(x2.getValue(CPos("M1")), CValue()));
+    assert (x2.setCell(CPos("BL63"), "1"));
+    assert (x2.setCell(CPos("BM64"), "=BL63+1"));
+    assert (x2.setCell(CPos("ZZZ1000000"), "=BM64*BL63+1"));
+    assert (valueMatch(x2.getValue(CPos("ZZZ1000000")), CValue(3.0)));
+    oss.clear();
+    oss.str("");
+    assert (x2.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x3.load(iss));
+    assert (valueMatch(x3.getValue(CPos("ZZZ1000000")), CValue(3.0)));
+    assert (valueMatch(x3.getValue(CPos("K40")), CValue(1099511627776.0)));
+    x2.copyRect(CPos("N3"), CPos("M3"));
+    assert (valueMatch(x2.getValue(CPos("N3")), CValue()));
+    assert (x2.setCell(CPos("N4"), "7"));
+    assert (valueMatch(x2.getValue(CPos("N3")), CValue(7.0)));
+
+    CSpreadsheet x4;
+    for (int i = 1; i <= 200; i++)
+        assert (x4.setCell(CPos("A" + std::to_string(i)), std::to_string(i)));
+    assert (x4.setCell(CPos("B1"), "=sum(A1:A200)"));
+    assert (x4.setCell(CPos("B2"), "=min($A$10:A200)"));
+    assert (x4.setCell(CPos("B3"), "=max(A1:A$150)"));
+    assert (x4.setCell(CPos("B4"), "=count(A1:A201)"));
+    assert (x4.setCell(CPos("B5"), "=countval(7, A1:A200)"));
+    assert (x4.setCell(CPos("B6"), "=if(B5, \"yes\", \"no\")"));
+    assert (x4.setCell(CPos("B7"), "=sum(D1:E5)"));
+    assert (x4.setCell(CPos("B8"), "=count(D1:E5)"));
+    assert (valueMatch(x4.getValue(CPos("B1")), CValue(20100.0)));
+    assert (valueMatch(x4.getValue(CPos("B2")), CValue(10.0)));
+    assert (valueMatch(x4.getValue(CPos("B3")), CValue(150.0)));
+    assert (valueMatch(x4.getValue(CPos("B4")), CValue(200.0)));
+    assert (valueMatch(x4.getValue(CPos("B5")), CValue(1.0)));
+    assert (valueMatch(x4.getValue(CPos("B6")), CValue("yes")));
+    assert (valueMatch(x4.getValue(CPos("B7")), CValue()));
+    assert (valueMatch(x4.getValue(CPos("B8")), CValue(0.0)));
+    assert (x4.setCell(CPos("A7"), "text"));
+    assert (x4.setCell(CPos("A100"), "=A99*1000"));
+    assert (valueMatch(x4.getValue(CPos("B1")), CValue(20100.0 - 7 - 100 + 99000)));
+    assert (valueMatch(x4.getValue(CPos("B3")), CValue(99000.0)));
+    assert (valueMatch(x4.getValue(CPos("B5")), CValue(0.0)));
+    assert (valueMatch(x4.getValue(CPos("B6")), CValue("no")));
+    assert (x4.setCell(CPos("C1"), "=countval(\"text\", A1:A10)"));
+    assert (valueMatch(x4.getValue(CPos("C1")), CValue(1.0)));
+    x4.copyRect(CPos("C2"), CPos("B1"));
+    assert (valueMatch(x4.getValue(CPos("C2")), CValue(99210.0)));
+    assert (x4.setCell(CPos("A50"), "=sum(A40:A60)"));
+    assert (valueMatch(x4.getValue(CPos("A50")), CValue()));
+    assert (valueMatch(x4.getValue(CPos("B1")), CValue()));
+    assert (valueMatch(x4.getValue(CPos("B2")), CValue()));
+    assert (x4.setCell(CPos("A50"), "50"));
+    assert (valueMatch(x4.getValue(CPos("B2")), CValue(10.0)));
+    assert (valueMatch(x4.getValue(CPos("B1")), CValue(20100.0 - 7 - 100 + 99000)));
+
+    CSpreadsheet x5;
+    for (int i = 1; i <= 1000; i++) {
+        assert (x5.setCell(CPos("A" + std::to_string(i)), std::to_string(i)));
+        assert (x5.setCell(CPos("B" + std::to_string(i)), "=sum($A$1:A" + std::to_string(i) + ")"));
+    }
+    assert (valueMatch(x5.getValue(CPos("B1000")), CValue(500500.0)));
+    assert (valueMatch(x5.getValue(CPos("B500")), CValue(125250.0)));
+    assert (x5.setCell(CPos("A300"), "1e20"));
+    assert (x5.setCell(CPos("A300"), "300.5"));
+    assert (valueMatch(x5.getValue(CPos("B1000")), CValue(500500.5)));
+    assert (valueMatch(x5.getValue(CPos("B299")), CValue(44850.0)));
+    assert (x5.setCell(CPos("A400"), "=A1*2"));
+    assert (x5.setCell(CPos("A401"), "label"));
+    assert (x5.setCell(CPos("C1"), "=count(A1:A1000)"));
+    assert (valueMatch(x5.getValue(CPos("B1000")), CValue(500500.5 - 400 + 2 - 401)));
+    assert (valueMatch(x5.getValue(CPos("C1")), CValue(1000.0)));
+    assert (x5.setCell(CPos("A500"), "=1/0"));
+    assert (valueMatch(x5.getValue(CPos("C1")), CValue(999.0)));
+    assert (x5.setCell(CPos("A600"), "=1e308*10"));
+    assert (valueMatch(x5.getValue(CPos("B1000")), CValue(std::numeric_limits<double>::infinity())));
+    assert (x5.setCell(CPos("A600"), "600"));
+    assert (valueMatch(x5.getValue(CPos("B1000")), CValue(500500.5 - 400 + 2 - 401 - 500)));
+    //Rows above the indexed blocks are scanned, also in a column that has no index because all its cells are there
+    assert (x5.setCell(CPos("D4500000"), "5"));
+    assert (x5.setCell(CPos("A4500000"), "label"));
+    assert (x5.setCell(CPos("E1"), "=sum(D1:D5000000)"));
+    assert (x5.setCell(CPos("E2"), "=count(D1:D5000000)"));
+    assert (x5.setCell(CPos("E3"), "=count(A1:A5000000)"));
+    assert (valueMatch(x5.getValue(CPos("E1")), CValue(5.0)));
+    assert (valueMatch(x5.getValue(CPos("E2")), CValue(1.0)));
+    assert (valueMatch(x5.getValue(CPos("E3")), CValue(1000.0)));
+
+    CSpreadsheet x6;
+    assert (x6.setCell(CPos("A1"), "2"));
+    assert (x6.setCell(CPos("B1"), "=-$A$1^2"));
+    assert (x6.setCell(CPos("B2"), "=(-$A$1)^2"));
+    assert (x6.setCell(CPos("B3"), "=2^3^2+2^(3^2)"));
+    assert (x6.setCell(CPos("B4"), "=$A$1-(1-1)/(4/2)"));
+    assert (x6.setCell(CPos("B5"), "=if($A$1<>2, 1, if($A$1=2, \"a\"\"b\", 0))"));
+    assert (x6.setCell(CPos("B6"), "=if(\"s\", 1, 2)"));
+    assert (x6.setCell(CPos("B7"), "=\"a\"+Z99"));
+    assert (x6.setCell(CPos("B8"), "=($A$1<3)=(1>=0)"));
+    assert (x6.setCell(CPos("B9"), "=countval(if($A$1, 2, 3), $A$1:$A$5)+0.125"));
+    x6.copyRect(CPos("D1"), CPos("B1"), 1, 9);
+    oss.clear();
+    oss.str("");
+    assert (x6.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x3.load(iss));
+    for (CSpreadsheet* sheet : {&x6, &x3}) {
+        assert (valueMatch(sheet->getValue(CPos("D1")), CValue(-4.0)));
+        assert (valueMatch(sheet->getValue(CPos("D2")), CValue(4.0)));
+        assert (valueMatch(sheet->getValue(CPos("D3")), CValue(576.0)));
+        assert (valueMatch(sheet->getValue(CPos("D4")), CValue(2.0)));
+        assert (valueMatch(sheet->getValue(CPos("D5")), CValue("a\"b")));
+        assert (valueMatch(sheet->getValue(CPos("D6")), CValue()));
+        assert (valueMatch(sheet->getValue(CPos("D7")), CValue()));
+        assert (valueMatch(sheet->getValue(CPos("D8")), CValue(1.0)));
+        assert (valueMatch(sheet->getValue(CPos("D9")), CValue(1.125)));
+    }
+    assert (x6.setCell(CPos("E1"), "=if(A1, \"a string too long for small buffers \" + A1, \"\")"));
+    x3 = x6;
+    x6.copyRect(CPos("E2"), CPos("E1"));
+    assert (x6.setCell(CPos("E1"), "0"));
+    assert (valueMatch(x3.getValue(CPos("E1")), CValue("a string too long for small buffers 2.000000")));
+    assert (valueMatch(x6.getValue(CPos("E2")), CValue()));
+    assert (x6.setCell(CPos("A2"), "1"));
+    assert (valueMatch(x6.getValue(CPos("E2")), CValue("a string too long for small buffers 1.000000")));
+
+    CSpreadsheet x7;
+    for (int i = 0; i < 200; i++) {
+        assert (x7.setCell(CPos("A" + std::to_string(i)), std::to_string(i)));
+        assert (x7.setCell(CPos("B" + std::to_string(i)), "=A" + std::to_string(i) + "*2"));
+    }
+    assert (x7.setCell(CPos("C0"), "=sum(B0:B199)"));
+    assert (valueMatch(x7.getValue(CPos("B5")), CValue(10.0)));
+    CSpreadsheet x8(x7);
+    assert (x7.setCell(CPos("A5"), "100"));
+    assert (x8.setCell(CPos("A6"), "=A5-1"));
+    assert (valueMatch(x8.getValue(CPos("C0")), CValue(39800.0 - 4)));
+    assert (valueMatch(x7.getValue(CPos("C0")), CValue(39800.0 + 190)));
+    assert (valueMatch(x8.getValue(CPos("B5")), CValue(10.0)));
+    assert (valueMatch(x7.getValue(CPos("B5")), CValue(200.0)));
+    assert (valueMatch(x8.getValue(CPos("B6")), CValue(8.0)));
+    assert (valueMatch(x7.getValue(CPos("B6")), CValue(12.0)));
+    x3 = x8;
+    x8 = x7;
+    assert (x7.setCell(CPos("A199"), "=B199"));
+    assert (valueMatch(x7.getValue(CPos("C0")), CValue()));
+    assert (valueMatch(x8.getValue(CPos("C0")), CValue(39800.0 + 190)));
+    assert (valueMatch(x3.getValue(CPos("B6")), CValue(8.0)));
+    x3.copyRect(CPos("D0"), CPos("B0"), 1, 200);
+    assert (valueMatch(x3.getValue(CPos("D0")), CValue(2 * (39800.0 - 4))));
+    assert (valueMatch(x8.getValue(CPos("D0")), CValue()));
+    assert (x8.setCell(CPos("B150"), "=C0"));
+    assert (valueMatch(x8.getValue(CPos("C0")), CValue()));
+    assert (valueMatch(x8.getValue(CPos("B150")), CValue()));
+    assert (valueMatch(x7.getValue(CPos("B150")), CValue(300.0)));
+
+    CSpreadsheet x9;
+    for (int i = 0; i < 1000; i++) {
+        assert (x9.setCell(CPos("A" + std::to_string(i)), std::to_string(i + 1)));
+    }
+    assert (x9.setCell(CPos("B0"), "=A0*2+$A$0"));
+    for (int filled = 1; filled < 1000; filled *= 2) {
+        x9.copyRect(CPos("B" + std::to_string(filled)), CPos("B0"), 1, std::min(filled, 1000 - filled));
+    }
+    assert (x9.setCell(CPos("C1"), "=sum(B0:B999)"));
+    assert (x9.setCell(CPos("D1"), "=a0 * 2 + $A$0"));
+    assert (valueMatch(x9.getValue(CPos("B999")), CValue(2001.0)));
+    assert (valueMatch(x9.getValue(CPos("C1")), CValue(1002000.0)));
+    assert (valueMatch(x9.getValue(CPos("D1")), CValue(3.0)));
+    assert (x9.setCell(CPos("A0"), "0"));
+    assert (valueMatch(x9.getValue(CPos("B999")), CValue(2000.0)));
+    assert (valueMatch(x9.getValue(CPos("D1")), CValue(0.0)));
+    oss.clear();
+    oss.str("");
+    assert (x9.save(oss));
+    assert (oss.str().find("B|500|=A500*2+$A$0\n") != std::string::npos);
+    assert (oss.str().find("D|1|=A0*2+$A$0\n") != std::string::npos);
+    assert (x9.setCell(CPos("E1"), "=if(-(a0 - 1) ^ 2 > 0, countval(\"a\"\"\n\", A0:B1), -$B$1 / (2 * B0 - 1))"));
+    oss.clear();
+    oss.str("");
+    assert (x9.save(oss));
+    assert (oss.str().find("E|1|=if(-(A0-1)^2>0,countval(\"a\"\"\\n\",A0:B1),-$B$1/(2*B0-1))\n") != std::string::npos);
 
+    CSpreadsheet x10;
+    for (const char* invalid : {"=", "=1+", "=(1", "=1)", "=1 2", "=\"abc", "=A1:B2", "=sum(A1)", "=sum(A1:A2,1)",
+                                "=if(1,2)", "=foo(1)", "=A", "=1..2", "=2e", "=$$A1", "=A1:", "=countval(A1:A2,A1)"}) {
+        assert (!x10.setCell(CPos("A1"), invalid));
+    }
+    assert (!x10.setCell(CPos("A1"), "=" + std::string(5000, '(') + "1" + std::string(5000, ')')));
+    assert (x10.setCell(CPos("A1"), "= 1 + 2 * 3 "));
+    assert (x10.setCell(CPos("A2"), "=2^-1+-2^2+(-2)^2"));
+    assert (x10.setCell(CPos("A3"), "=1<2=1<>0"));
+    assert (x10.setCell(CPos("A4"), "=\"a\"\"b\"=\"a\"\"\"+\"b\""));
+    assert (x10.setCell(CPos("A5"), "=SUM (a1:$A$2)+CountVal(7, A1:A1)"));
+    assert (x10.setCell(CPos("A6"), "=1e+2+.5+2.+1E-1"));
+    assert (x10.setCell(CPos("A7"), "=1e400"));
+    assert (x10.setCell(CPos("A8"), "=" + std::string(500, '(') + "-1" + std::string(500, ')')));
+    assert (valueMatch(x10.getValue(CPos("A1")), CValue(7.0)));
+    assert (valueMatch(x10.getValue(CPos("A2")), CValue(0.5)));
+    assert (valueMatch(x10.getValue(CPos("A3")), CValue(1.0)));
+    assert (valueMatch(x10.getValue(CPos("A4")), CValue(1.0)));
+    assert (valueMatch(x10.getValue(CPos("A5")), CValue(8.5)));
+    assert (valueMatch(x10.getValue(CPos("A6")), CValue(102.6)));
+    assert (valueMatch(x10.getValue(CPos("A7")), CValue(std::numeric_limits<double>::infinity())));
+    assert (valueMatch(x10.getValue(CPos("A8")), CValue(-1.0)));
+    assert (!x10.setCell(CPos("A9"), "=A99999999999"));
+    assert (x10.setCell(CPos("A9"), "=\"\"\"\"+\"x\"+\"\""));
+    assert (valueMatch(x10.getValue(CPos("A9")), CValue("\"x")));
+
+    CSpreadsheet x11;
+    assert (x11.setCell(CPos("A1"), "10.5"));
+    assert (x11.setCell(CPos("A2"), "line\nbreak"));
+    assert (x11.setCell(CPos("A3"), ""));
+    assert (x11.setCell(CPos("B1"), "=A1*2+$A$1"));
+    assert (x11.setCell(CPos("B2"), "=A2*2+$A$1"));
+    assert (x11.setCell(CPos("C1"), "=if(A1>1,sum(A1:B2),\"x\"\"y\")"));
+    assert (x11.setCell(CPos("D1"), "=D2"));
+    assert (x11.setCell(CPos("D2"), "=D1"));
+    oss.clear();
+    oss.str("");
+    assert (x11.saveBinary(oss));
+    std::string image = oss.str();
+    CSpreadsheet x12;
+    assert (x12.setCell(CPos("Z9"), "keep"));
+    iss.clear();
+    iss.str(image);
+    assert (x12.loadBinary(iss));
+    assert (valueMatch(x12.getValue(CPos("Z9")), CValue()));
+    assert (valueMatch(x12.getValue(CPos("A2")), CValue("line\nbreak")));
+    assert (valueMatch(x12.getValue(CPos("B1")), CValue(31.5)));
+    assert (valueMatch(x12.getValue(CPos("B2")), CValue()));
+    assert (valueMatch(x12.getValue(CPos("C1")), CValue(42.0)));
+    assert (valueMatch(x12.getValue(CPos("D1")), CValue()));
+    assert (x12.setCell(CPos("A1"), "1"));
+    assert (valueMatch(x12.getValue(CPos("C1")), CValue("x\"y")));
+    assert (valueMatch(x11.getValue(CPos("C1")), CValue(42.0)));
+    for (size_t i = 0; i < image.size(); i += 7) {
+        std::string corrupted = image;
+        corrupted[i] ^= 0x20;
+        iss.clear();
+        iss.str(corrupted);
+        assert (!x12.loadBinary(iss));
+    }
+    //The counts and offsets of the 96 byte header are checked too, a smaller cell count must not truncate the sheet
+    for (size_t i = 0; i < 96; i++) {
+        std::string corrupted = image;
+        corrupted[i] ^= 0x01;
+        iss.clear();
+        iss.str(corrupted);
+        assert (!x12.loadBinary(iss));
+    }
+    //A record outside the sheet is rejected even under a valid checksum, the first record follows the header
+    for (auto [row, col] : {std::pair(-1, 1), std::pair(0, 0), std::pair(5, 3)}) {
+        std::string corrupted = image;
+        std::memcpy(corrupted.data() + 96, &row, sizeof(row));
+        std::memcpy(corrupted.data() + 100, &col, sizeof(col));
+        uint32_t checksum = 0;
+        std::memcpy(corrupted.data() + 12, &checksum, sizeof(checksum));
+        checksum = crc32(corrupted.data(), corrupted.size());
+        std::memcpy(corrupted.data() + 12, &checksum, sizeof(checksum));
+        iss.clear();
+        iss.str(corrupted);
+        assert (x12.loadBinary(iss) == (col == 3));
+    }
+    assert (valueMatch(x12.getValue(CPos("C5")), CValue(10.5)));
+    assert (x12.setCell(CPos("A1"), "1"));
+    //Programs are stored with zeroed padding, so the same sheet compiled again from its text saves the same image
+    oss.clear();
+    oss.str("");
+    assert (x11.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x3.load(iss));
+    oss.clear();
+    oss.str("");
+    assert (x3.saveBinary(oss));
+    assert (oss.str() == image);
+    iss.clear();
+    iss.str(image.substr(0, image.size() - 1));
+    assert (!x12.loadBinary(iss));
+    assert (valueMatch(x12.getValue(CPos("C1")), CValue("x\"y")));
+
+    CSpreadsheet x13;
+    assert (x13.setCell(CPos("A1"), "0.1"));
+    assert (x13.setCell(CPos("A2"), "=A1*3"));
+    assert (x13.setCell(CPos("B1"), "back\\slash\r\nnext"));
+    assert (x13.setCell(CPos("AA10"), "=\"=not a formula\"+\"\n\""));
+    assert (x13.setCell(CPos("AA11"), "=AA10"));
+    x13.copyRect(CPos("AA12"), CPos("AA10"));
+    oss.clear();
+    oss.str("");
+    assert (x13.save(oss));
+    data = oss.str();
+    iss.clear();
+    iss.str(data);
+    CSpreadsheet x14;
+    assert (x14.load(iss));
+    assert (valueMatch(x14.getValue(CPos("A1")), CValue(0.1)));
+    assert (valueMatch(x14.getValue(CPos("A2")), CValue(0.1 * 3)));
+    assert (valueMatch(x14.getValue(CPos("B1")), CValue("back\\slash\r\nnext")));
+    assert (valueMatch(x14.getValue(CPos("AA11")), CValue("=not a formula\n")));
+    assert (valueMatch(x14.getValue(CPos("AA12")), CValue("=not a formula\n")));
+    assert (valueMatch(x1.getValue(CPos("A6")), x0.getValue(CPos("A6"))));
+    for (size_t i = 0; i < data.size(); i++) {
+        std::string corrupted = data;
+        corrupted[i] ^= 0x01;
+        iss.clear();
+        iss.str(corrupted);
+        assert (!x14.load(iss));
+        iss.clear();
+        iss.str(data.substr(0, i));
+        assert (!x14.load(iss));
+    }
+    assert (valueMatch(x14.getValue(CPos("AA11")), CValue("=not a formula\n")));
+    for (int row = 0; row < 10000; row++) {
+        assert (x13.setCell(CPos("C" + std::to_string(row)), row ? "=$C$0+" + std::to_string(row) : "1e-3"));
+    }
+    oss.clear();
+    oss.str("");
+    assert (x13.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x14.load(iss));
+    assert (valueMatch(x14.getValue(CPos("C9999")), CValue(9999.001)));
+    data = oss.str();
+    for (size_t i : {data.size() / 3, data.size() - 100}) {
+        std::string corrupted = data;
+        corrupted[i] ^= 0x01;
+        iss.clear();
+        iss.str(corrupted);
+        assert (!x13.load(iss));
+    }
+    assert (valueMatch(x13.getValue(CPos("C9999")), CValue(9999.001)));
+    assert (valueMatch(x13.getValue(CPos("AA10")), CValue("=not a formula\n")));
 
+    CSpreadsheet x15;
+    assert (x15.setCell(CPos("A0"), "1"));
+    for (int row = 1; row < 20000; row++) {
+        assert (x15.setCell(CPos("A" + std::to_string(row)), "=A" + std::to_string(row - 1) + "+1"));
+    }
+    for (int row = 1; row < 100; row++) {
+        assert (x15.setCell(CPos("B" + std::to_string(row)), "=sum(A0:A" + std::to_string(row) + ")-A" + std::to_string(row)));
+    }
+    assert (x15.setCell(CPos("B19999"), "=sum(A0:A19999)-A19999"));
+    assert (x15.setCell(CPos("C0"), "=C1+B19999"));
+    assert (x15.setCell(CPos("C1"), "=C0"));
+    assert (x15.setCell(CPos("C2"), "=C1+1"));
+    assert (x15.setCell(CPos("C3"), "=A19999*2"));
+    x15.recalculateAll();
+    assert (valueMatch(x15.getValue(CPos("A19999")), CValue(20000.0)));
+    assert (valueMatch(x15.getValue(CPos("B19999")), CValue(19999.0 * 20000 / 2)));
+    assert (valueMatch(x15.getValue(CPos("C0")), CValue()));
+    assert (valueMatch(x15.getValue(CPos("C2")), CValue()));
+    assert (valueMatch(x15.getValue(CPos("C3")), CValue(40000.0)));
+    assert (x15.setCell(CPos("A0"), "2"));
+    x15.recalculateAll();
+    assert (valueMatch(x15.getValue(CPos("C3")), CValue(40002.0)));
+    assert (valueMatch(x15.getValue(CPos("B2")), CValue(5.0)));
+    //Edits read lazily between recalculations leave stale entries in the dirty list, they are dropped or skipped
+    for (int round = 3; round < 10; round++) {
+        assert (x15.setCell(CPos("A0"), std::to_string(round)));
+        assert (valueMatch(x15.getValue(CPos("A5")), CValue(round + 5.0)));
+    }
+    assert (x15.setCell(CPos("A5"), "0"));
+    x15.recalculateAll();
+    assert (valueMatch(x15.getValue(CPos("C3")), CValue(2.0 * 19994)));
+    oss.clear();
+    oss.str("");
+    assert (x15.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x3.load(iss));
+    x3.recalculateAll();
+    assert (valueMatch(x3.getValue(CPos("B19999")), x15.getValue(CPos("B19999"))));
+    assert (valueMatch(x3.getValue(CPos("C0")), CValue()));
+
+    ConcurrentSpreadsheet x16;
+    assert (x16.setCell(CPos("A1"), "0"));
+    assert (x16.setCell(CPos("B1"), "=A1*2"));
+    assert (x16.setCell(CPos("C1"), "=sum(A1:B1)"));
+    std::atomic<bool> writing = true;
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 2; i++) {
+        readers.emplace_back([&x16, &writing]() {
+            while (writing) {
+                auto snapshot = x16.snapshot();
+                double a = std::get<double>(snapshot->getValue(CPos("A1")));
+                assert (valueMatch(snapshot->getValue(CPos("B1")), CValue(a * 2)));
+                assert (valueMatch(snapshot->getValue(CPos("C1")), CValue(a * 3)));
+                assert (std::holds_alternative<double>(x16.getValue(CPos("C1"))));
+            }
+        });
+    }
+    for (int i = 1; i <= 200; i++) {
+        assert (x16.setCell(CPos("A1"), std::to_string(i)));
+        if (i % 10 == 0)
+            x16.copyRect(CPos("D1"), CPos("B1"));
+    }
+    writing = false;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    assert (valueMatch(x16.getValue(CPos("C1")), CValue(600.0)));
+    assert (valueMatch(x16.getValue(CPos("D1")), CValue(1200.0)));
+
+    CSpreadsheet x17;
+    assert (x17.setCell(CPos("A1"), "1"));
+    assert (x17.setCell(CPos("B1"), "=A1+A2"));
+    std::vector<CSpreadsheet::Edit> edits = {{CPos("A1"), "10"}, {CPos("A2"), "=A1*2"}, {CPos("A3"), "=1+"}};
+    assert (!x17.applyEdits(edits));
+    assert (valueMatch(x17.getValue(CPos("A1")), CValue(1.0)));
+    assert (valueMatch(x17.getValue(CPos("A2")), CValue()));
+    assert (valueMatch(x17.getValue(CPos("B1")), CValue()));
+    edits.back() = {CPos("A1"), "100"};
+    for (int row = 10; row < 1000; row++) {
+        edits.push_back({CPos("C" + std::to_string(row)), "=A$1+" + std::to_string(row)});
+    }
+    assert (x17.applyEdits(edits));
+    assert (valueMatch(x17.getValue(CPos("A2")), CValue(200.0)));
+    assert (valueMatch(x17.getValue(CPos("B1")), CValue(300.0)));
+    assert (valueMatch(x17.getValue(CPos("C999")), CValue(1099.0)));
+    assert (x17.applyEdits(std::vector<CSpreadsheet::Edit>{{CPos("A1"), "1"}, {CPos("A2"), "x"}}));
+    assert (valueMatch(x17.getValue(CPos("B1")), CValue("1.000000x")));
+    assert (valueMatch(x17.getValue(CPos("C999")), CValue(1000.0)));
+
+    CSpreadsheet x18;
+    assert (x18.setCell(CPos("A1"), "=sum(B2:D3)"));
+    assert (x18.setCell(CPos("D3"), "kept"));
+    iss.clear();
+    iss.str("1,abc,\"q\"\"uote\"\r\n2.5,\"multi\nline\",,=A1\n\n\"\",1e3");
+    assert (x18.loadCsv(iss, CPos("B2")));
+    assert (valueMatch(x18.getValue(CPos("B2")), CValue(1.0)));
+    assert (valueMatch(x18.getValue(CPos("C2")), CValue("abc")));
+    assert (valueMatch(x18.getValue(CPos("D2")), CValue("q\"uote")));
+    assert (valueMatch(x18.getValue(CPos("C3")), CValue("multi\nline")));
+    assert (valueMatch(x18.getValue(CPos("D3")), CValue("kept")));
+    assert (valueMatch(x18.getValue(CPos("E3")), CValue("=A1")));
+    assert (valueMatch(x18.getValue(CPos("B5")), CValue("")));
+    assert (valueMatch(x18.getValue(CPos("C5")), CValue(1000.0)));
+    assert (valueMatch(x18.getValue(CPos("A1")), CValue(3.5)));
+    for (const char* invalid : {"1,\"open\n2", "\"a\"b,1"}) {
+        iss.clear();
+        iss.str(invalid);
+        assert (!x18.loadCsv(iss, CPos("B2")));
+    }
+    assert (valueMatch(x18.getValue(CPos("B2")), CValue(1.0)));
+    std::string csv;
+    for (int row = 0; row < 40000; row++) {
+        csv += std::to_string(row) + ",\"text, " + std::to_string(row) + "\",0.25\n";
+    }
+    assert (x18.setCell(CPos("A2"), "=sum(A3:A40002)"));
+    iss.clear();
+    iss.str(csv);
+    assert (x18.loadCsv(iss, CPos("A3")));
+    assert (valueMatch(x18.getValue(CPos("B40002")), CValue("text, 39999")));
+    assert (valueMatch(x18.getValue(CPos("C20000")), CValue(0.25)));
+    assert (valueMatch(x18.getValue(CPos("A2")), CValue(39999.0 * 40000 / 2)));
+
+    CSpreadsheet x19;
+    assert (x19.setCell(CPos("A1"), "12abc"));
+    assert (x19.setCell(CPos("A2"), "1e400"));
+    assert (x19.setCell(CPos("A3"), "-2.5e-3"));
+    assert (x19.setCell(CPos("A4"), "=A1+1"));
+    assert (valueMatch(x19.getValue(CPos("A1")), CValue("12abc")));
+    assert (valueMatch(x19.getValue(CPos("A2")), CValue("1e400")));
+    assert (valueMatch(x19.getValue(CPos("A3")), CValue(-2.5e-3)));
+    assert (valueMatch(x19.getValue(CPos("A4")), CValue("12abc1.000000")));
+    //The syntax accepted by std::stod stays numeric
+    assert (x19.setCell(CPos("B1"), "+5"));
+    assert (x19.setCell(CPos("B2"), " 12"));
+    assert (x19.setCell(CPos("B3"), "\t-0x1A"));
+    assert (x19.setCell(CPos("B4"), "+-5"));
+    assert (x19.setCell(CPos("B5"), "12 "));
+    assert (x19.setCell(CPos("B6"), "+"));
+    assert (valueMatch(x19.getValue(CPos("B1")), CValue(5.0)));
+    assert (valueMatch(x19.getValue(CPos("B2")), CValue(12.0)));
+    assert (valueMatch(x19.getValue(CPos("B3")), CValue(-26.0)));
+    assert (valueMatch(x19.getValue(CPos("B4")), CValue("+-5")));
+    assert (valueMatch(x19.getValue(CPos("B5")), CValue("12 ")));
+    assert (valueMatch(x19.getValue(CPos("B6")), CValue("+")));
+
+    CSpreadsheet x20;
+    assert (x20.setCell(CPos("A1"), "1"));
+    assert (x20.setCell(CPos("A2"), "=A1+1"));
+    assert (x20.setCell(CPos("A3"), "=A2+1"));
+    assert (x20.setCell(CPos("B1"), "=A1*10"));
+    x20.copyRect(CPos("A2"), CPos("A1"), 2, 3);
+    assert (valueMatch(x20.getValue(CPos("A2")), CValue(1.0)));
+    assert (valueMatch(x20.getValue(CPos("A4")), CValue(3.0)));
+    assert (valueMatch(x20.getValue(CPos("B2")), CValue(10.0)));
+    assert (valueMatch(x20.getValue(CPos("B3")), CValue()));
+    x20.copyRect(CPos("B2"), CPos("A2"), 2, 3);
+    assert (valueMatch(x20.getValue(CPos("B4")), CValue(3.0)));
+    assert (valueMatch(x20.getValue(CPos("C2")), CValue(10.0)));
+    x20.copyRect(CPos("A1"), CPos("B2"), 2, 3);
+    assert (valueMatch(x20.getValue(CPos("A1")), CValue(1.0)));
+    assert (valueMatch(x20.getValue(CPos("A3")), CValue(3.0)));
+    assert (valueMatch(x20.getValue(CPos("B1")), CValue(10.0)));
+    //An overflowing literal is infinite, it is saved as a literal the parser reads back as infinity
+    assert (x20.setCell(CPos("D1"), "=1e400"));
+    assert (x20.setCell(CPos("D2"), "=-1e400*A1"));
+    //(-0)^x is 1, it must not be saved as -0^x, which reads back as -(0^x)
+    assert (x20.setCell(CPos("D3"), "=(-0)^E1"));
+    assert (x20.setCell(CPos("E1"), "0"));
+    assert (valueMatch(x20.getValue(CPos("D3")), CValue(1.0)));
+    oss.clear();
+    oss.str("");
+    assert (x20.save(oss));
+    assert (oss.str().find("D|1|=1e999\n") != std::string::npos);
+    iss.clear();
+    iss.str(oss.str());
+    assert (x20.load(iss));
+    assert (valueMatch(x20.getValue(CPos("D1")), CValue(std::numeric_limits<double>::infinity())));
+    assert (valueMatch(x20.getValue(CPos("D2")), CValue(-std::numeric_limits<double>::infinity())));
+    assert (valueMatch(x20.getValue(CPos("D3")), CValue(1.0)));
+
+    CSpreadsheet x21;
+    for (int row = 0; row < 300; row++) {
+        assert (x21.setCell(CPos("A" + std::to_string(row)), row % 3 ? "OK" : "N/A"));
+    }
+    assert (x21.setCell(CPos("B0"), "=\"O\"+\"K\""));
+    assert (x21.setCell(CPos("C0"), "=countval(\"OK\", A0:B299)"));
+    assert (x21.setCell(CPos("C1"), "=countval(\"N/A\", A0:A299)"));
+    assert (x21.setCell(CPos("C2"), "=countval(\"missing\", A0:A299)"));
+    assert (valueMatch(x21.getValue(CPos("C0")), CValue(201.0)));
+    assert (valueMatch(x21.getValue(CPos("C1")), CValue(100.0)));
+    assert (valueMatch(x21.getValue(CPos("C2")), CValue(0.0)));
+    for (int row = 0; row < 300; row += 3) {
+        assert (x21.setCell(CPos("A" + std::to_string(row)), "OK"));
+    }
+    assert (valueMatch(x21.getValue(CPos("C0")), CValue(301.0)));
+    assert (valueMatch(x21.getValue(CPos("C1")), CValue(0.0)));
+    assert (x21.setCell(CPos("A299"), "N/A"));
+    oss.clear();
+    oss.str("");
+    assert (x21.saveBinary(oss));
+    assert (x21.setCell(CPos("A0"), "N/A"));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x21.loadBinary(iss));
+    assert (valueMatch(x21.getValue(CPos("A0")), CValue("OK")));
+    assert (valueMatch(x21.getValue(CPos("C0")), CValue(300.0)));
+    assert (valueMatch(x21.getValue(CPos("C1")), CValue(1.0)));
+    oss.clear();
+    oss.str("");
+    assert (x21.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x21.load(iss));
+    assert (x21.setCell(CPos("A1"), "N/A"));
+    assert (valueMatch(x21.getValue(CPos("C0")), CValue(299.0)));
+    assert (valueMatch(x21.getValue(CPos("C1")), CValue(2.0)));
+
+    CSpreadsheet x22;
+    assert (x22.setCell(CPos("A1"), "abc"));
+    assert (x22.setCell(CPos("A2"), "2"));
+    assert (x22.setCell(CPos("B1"), "=2^10*A2"));
+    assert (x22.setCell(CPos("B2"), "=\"a\"+\"b\"+1"));
+    assert (x22.setCell(CPos("B3"), "=-(-A1)"));
+    assert (x22.setCell(CPos("B4"), "=-(-(A2*3))/1-0"));
+    assert (x22.setCell(CPos("B5"), "=A1*1"));
+    assert (x22.setCell(CPos("B6"), "=1*(A2^2)^1"));
+    assert (x22.setCell(CPos("B7"), "=(1/0)*1"));
+    assert (x22.setCell(CPos("B8"), "=\"a\"*2+10^400"));
+    assert (x22.setCell(CPos("B9"), "=(\"abc\"<\"abd\")+-(1-3)"));
+    assert (valueMatch(x22.getValue(CPos("B1")), CValue(2048.0)));
+    assert (valueMatch(x22.getValue(CPos("B2")), CValue("ab1.000000")));
+    assert (valueMatch(x22.getValue(CPos("B3")), CValue()));
+    assert (valueMatch(x22.getValue(CPos("B4")), CValue(6.0)));
+    assert (valueMatch(x22.getValue(CPos("B5")), CValue()));
+    assert (valueMatch(x22.getValue(CPos("B6")), CValue(4.0)));
+    assert (valueMatch(x22.getValue(CPos("B7")), CValue()));
+    assert (valueMatch(x22.getValue(CPos("B8")), CValue()));
+    assert (valueMatch(x22.getValue(CPos("B9")), CValue(3.0)));
+    oss.clear();
+    oss.str("");
+    assert (x22.save(oss));
+    for (const char* folded : {"B|1|=1024*A2\n", "B|2|=\"ab1.000000\"\n", "B|3|=--A1\n", "B|4|=A2*3\n", "B|5|=A1*1\n",
+                               "B|6|=A2^2\n", "B|7|=1/0\n", "B|8|=\"a\"*2+10^400\n", "B|9|=3\n"}) {
+        assert (oss.str().find(folded) != std::string::npos);
+    }
+    //The result of if() may be a text, so the identities must not pass through it
+    assert (x22.setCell(CPos("C1"), "=-(-if(1,\"a\",\"b\"))"));
+    assert (x22.setCell(CPos("C2"), "=if(A2>0,\"x\",\"y\")*1"));
+    assert (x22.setCell(CPos("C3"), "=if(A2>0,\"x\",\"y\")/1"));
+    assert (x22.setCell(CPos("C4"), "=1*if(A2>0,\"x\",2)"));
+    assert (x22.setCell(CPos("C5"), "=-if(-(A2-1),1,2)"));
+    assert (x22.setCell(CPos("C6"), "=-count(A1:A4)*if(0.5,\"\",-A2)"));
+    assert (x22.setCell(CPos("C7"), "=-(-if(A2,-(A2*2),1))"));
+    assert (valueMatch(x22.getValue(CPos("C1")), CValue()));
+    assert (valueMatch(x22.getValue(CPos("C2")), CValue()));
+    assert (valueMatch(x22.getValue(CPos("C3")), CValue()));
+    assert (valueMatch(x22.getValue(CPos("C4")), CValue()));
+    assert (valueMatch(x22.getValue(CPos("C5")), CValue(-1.0)));
+    assert (valueMatch(x22.getValue(CPos("C6")), CValue()));
+    assert (valueMatch(x22.getValue(CPos("C7")), CValue(-4.0)));
+    oss.clear();
+    oss.str("");
+    assert (x22.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    CSpreadsheet x23;
+    assert (x23.load(iss));
+    for (const char* cell : {"B1", "B2", "B3", "B4", "B5", "B6", "B7", "B8", "B9", "C1", "C2", "C3", "C4", "C5", "C6", "C7"}) {
+        assert (valueMatch(x23.getValue(CPos(cell)), x22.getValue(CPos(cell))));
+    }
 
     return EXIT_SUCCESS;
 